@@ -0,0 +1,810 @@
+/*
+ * PLEASE LICENSE 11/2020, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * microbenchmark for the kitty transport primitives in kitty_util.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sched.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "kitty_util.h"
+
+static size_t size = 4 << 20;
+static uint iterations = 50;
+static uint max_frame = 4096;
+static uint min_time_ms = 100;
+static uint warmup_ms = 250;
+static int cpu = -1;
+static uint help = 0;
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * fill buffer with a deterministic pseudo-random pattern
+ */
+static void bench_fill(uint8_t *buf, size_t len)
+{
+    uint32_t x = 0x9e3779b9;
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+}
+
+/*
+ * check each base64 variant is byte identical to the scalar encoder
+ * for every length up to 256 bytes and the full benchmark size.
+ */
+static int bench_base64_verify(const uint8_t *in, size_t len)
+{
+    size_t out_len = ((len + 2) / 3) * 4 + 1;
+    char *ref = malloc(out_len), *out = malloc(out_len);
+    int fail = 0;
+
+    for (size_t i = 1; i < base64_impl_count; i++) {
+        const base64_impl *impl = &base64_impls[i];
+        if (!impl->supported()) continue;
+        for (size_t n = 0; n <= 256 && n <= len; n++) {
+            size_t o = ((n + 2) / 3) * 4 + 1;
+            int r1 = base64_encode_scalar(n, in, o, ref);
+            int r2 = impl->encode(n, in, o, out);
+            if (r1 != r2 || memcmp(ref, out, o) != 0) {
+                fprintf(stderr, "error: base64 %s mismatch at length %zu\n",
+                    impl->name, n);
+                fail++;
+                break;
+            }
+        }
+        int r1 = base64_encode_scalar(len, in, out_len, ref);
+        int r2 = impl->encode(len, in, out_len, out);
+        if (r1 != r2 || memcmp(ref, out, out_len) != 0) {
+            fprintf(stderr, "error: base64 %s mismatch at length %zu\n",
+                impl->name, len);
+            fail++;
+        }
+    }
+
+    free(ref);
+    free(out);
+    return fail;
+}
+
+static void bench_base64(const uint8_t *in, size_t len)
+{
+    size_t out_len = ((len + 2) / 3) * 4 + 1;
+    char *out = malloc(out_len);
+
+    for (size_t i = 0; i < base64_impl_count; i++) {
+        const base64_impl *impl = &base64_impls[i];
+        if (!impl->supported()) {
+            printf("base64 %-8s unsupported\n", impl->name);
+            continue;
+        }
+        impl->encode(len, in, out_len, out);
+        double t0 = bench_now();
+        for (uint j = 0; j < iterations; j++) {
+            impl->encode(len, in, out_len, out);
+        }
+        double t = bench_now() - t0;
+        printf("base64 %-8s %8.3f GB/s%s\n", impl->name,
+            (double)len * iterations / t * 1e-9,
+            impl == base64_select() ? " (selected)" : "");
+    }
+
+    free(out);
+}
+
+/*
+ * check the vector tile hash matches the scalar version for tile widths
+ * up to 64 pixels, walking rows both up and down.
+ */
+static int bench_tile_hash_verify(const uint8_t *in, size_t len)
+{
+    int fail = 0;
+
+    for (size_t row_size = 0; row_size <= 256 && row_size * 64 <= len;
+            row_size++) {
+        for (uint32_t rows = 0; rows <= 64; rows += 7) {
+            const uint8_t *last = in + (rows ? rows - 1 : 0) * 256;
+            if (kitty_tile_hash(in, 256, row_size, rows) !=
+                    kitty_tile_hash_scalar(in, 256, row_size, rows) ||
+                kitty_tile_hash(last, -256, row_size, rows) !=
+                    kitty_tile_hash_scalar(last, -256, row_size, rows)) {
+                fprintf(stderr, "error: tile hash mismatch at %zux%u\n",
+                    row_size, rows);
+                fail++;
+            }
+        }
+    }
+    return fail;
+}
+
+static void bench_tile_hash(const uint8_t *in, size_t len)
+{
+    size_t row_size = 256, rows = len / row_size;
+    volatile uint64_t h = 0;
+    double t0, t1, t2;
+
+    t0 = bench_now();
+    for (uint j = 0; j < iterations; j++) {
+        h += kitty_tile_hash_scalar(in, row_size, row_size, rows);
+    }
+    t1 = bench_now();
+    for (uint j = 0; j < iterations; j++) {
+        h += kitty_tile_hash(in, row_size, row_size, rows);
+    }
+    t2 = bench_now();
+    printf("tile hash scalar   %8.3f GB/s\n",
+        (double)row_size * rows * iterations / (t1 - t0) * 1e-9);
+    printf("tile hash vector   %8.3f GB/s\n",
+        (double)row_size * rows * iterations / (t2 - t1) * 1e-9);
+}
+
+/*
+ * a synthetic rendered frame: shaded discs on a black background, with
+ * long runs of identical pixels and many rows repeating the row above.
+ */
+static void bench_frame(uint8_t *buf, uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t *p = buf + ((size_t)y * width + x) * 4;
+            int dx = (int)(x % 256) - 128, dy = (int)(y % 256) - 128;
+            int in = dx * dx + dy * dy < 100 * 100;
+            p[0] = in ? (uint8_t)(64 + (x / 16) % 128) : 0;
+            p[1] = in ? (uint8_t)(32 + (y / 32) % 128) : 0;
+            p[2] = in ? 160 : 0;
+            p[3] = in ? 255 : 0;
+        }
+    }
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * check the pixel deflate encoder output inflates back to the input, for
+ * random and rendered pixels, RGBA and RGB, and rows read bottom up.
+ */
+static int bench_pixel_deflate_verify(const uint8_t *in, size_t len)
+{
+    uint32_t width = 1024, height = (uint32_t)(len / (width * 4));
+    uint8_t *frame = malloc(len), *check = malloc(len);
+    kitty_deflate out = { 0 };
+    int fail = 0;
+
+    bench_frame(frame, width, height);
+    for (uint i = 0; i < 8; i++) {
+        const uint8_t *pixels = i & 1 ? in : frame;
+        size_t pixel_size = i & 2 ? 3 : 4;
+        uint32_t w = i & 4 ? 13 : width;
+        size_t row_size = w * pixel_size;
+        uint32_t rows = (uint32_t)(len / row_size);
+        kitty_rows src = i & 4 ?
+            (kitty_rows) { pixels + (rows - 1) * row_size, row_size,
+                -(ptrdiff_t)row_size, rows } :
+            (kitty_rows) { pixels, row_size, (ptrdiff_t)row_size, rows };
+        zlib_span z = kitty_pixel_deflate(&out, src, pixel_size);
+        uLongf check_len = len;
+        int ret = uncompress(check, &check_len, z.data, z.len);
+        for (uint32_t y = 0; ret == Z_OK && y < rows; y++) {
+            if (memcmp(check + y * row_size, src.data + y * src.stride,
+                    row_size) != 0) {
+                ret = Z_DATA_ERROR;
+            }
+        }
+        if (ret != Z_OK || check_len != row_size * rows) {
+            fprintf(stderr, "error: pixel deflate mismatch in case %u\n", i);
+            fail++;
+        }
+    }
+    kitty_deflate_destroy(&out);
+    free(frame);
+    free(check);
+    return fail;
+}
+
+/*
+ * compare the pixel deflate encoder with zlib on a rendered frame
+ */
+static void bench_pixel_deflate(size_t len)
+{
+    uint32_t width = 1024, height = (uint32_t)(len / (width * 4));
+    size_t frame_len = (size_t)width * height * 4;
+    kitty_rows src;
+    uint8_t *frame = malloc(frame_len);
+    kitty_deflate out = { 0 };
+    kitty_zlib kz;
+    size_t zlen = 0, plen = 0;
+    double t0, t1, t2;
+
+    bench_frame(frame, width, height);
+    src = kitty_rows_span(frame, frame_len);
+    kitty_zlib_init(&kz);
+
+    t0 = bench_now();
+    for (uint j = 0; j < iterations; j++) {
+        zlen = kitty_zlib_compress(&kz, frame, frame_len,
+            kitty_compress_speed).len;
+    }
+    t1 = bench_now();
+    for (uint j = 0; j < iterations; j++) {
+        plen = kitty_pixel_deflate(&out, src, 4).len;
+    }
+    t2 = bench_now();
+    printf("deflate zlib -1    %8.3f GB/s %6.2fX\n",
+        (double)frame_len * iterations / (t1 - t0) * 1e-9,
+        (double)frame_len / zlen);
+    printf("deflate pixel      %8.3f GB/s %6.2fX\n",
+        (double)frame_len * iterations / (t2 - t1) * 1e-9,
+        (double)frame_len / plen);
+
+    kitty_zlib_destroy(&kz);
+    kitty_deflate_destroy(&out);
+    free(frame);
+}
+#endif
+
+/*
+ * a gears frame: the three gears of the demo as flat shaded toothed rings
+ * on a black background, drawn the same way up as OSMesa renders them.
+ */
+static void bench_gears(uint8_t *buf, uint32_t width, uint32_t height,
+    float angle)
+{
+    static const struct {
+        float x, y, inner, outer, rot; int teeth; uint8_t rgb[3];
+    } gears[3] = {
+        { -3.0f, -2.0f, 1.0f, 4.0f,  1.f,  20, { 204,  25,   0 } },
+        {  3.1f, -2.0f, 0.5f, 2.0f, -2.f,  10, {   0, 204,  51 } },
+        { -3.1f,  4.2f, 1.3f, 2.0f, -2.f,  10, {  51,  51, 255 } },
+    };
+    const float depth = 0.7f, scale = 16.f / width;
+
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t *p = buf + ((size_t)y * width + x) * 4;
+            float fx = x * scale - 8.f;
+            float fy = (y - height * 0.5f) * scale;
+            memset(p, 0, 4);
+            for (uint i = 0; i < 3; i++) {
+                float dx = fx - gears[i].x, dy = fy - gears[i].y;
+                float r = sqrtf(dx * dx + dy * dy);
+                if (r < gears[i].inner || r > gears[i].outer + depth) {
+                    continue;
+                }
+                float t = (atan2f(dy, dx) - gears[i].rot * angle *
+                    (float)M_PI / 180.f) * gears[i].teeth / (2.f * (float)M_PI);
+                float edge = t - floorf(t) < 0.5f ?
+                    gears[i].outer + depth * 0.5f : gears[i].outer - depth * 0.5f;
+                if (r > edge) continue;
+                p[0] = gears[i].rgb[0];
+                p[1] = gears[i].rgb[1];
+                p[2] = gears[i].rgb[2];
+                p[3] = 255;
+            }
+        }
+    }
+}
+
+/*
+ * frame benchmarks
+ *
+ * times the per-frame transport steps on square frames from 64x64 up to
+ * the maximum frame size. each step runs once untimed to warm caches and
+ * allocations, then repeats until it has run for the minimum time. rates
+ * are GB/s and cycles per byte of the RGBA frame. cycles are time stamp
+ * counter cycles, so they are only available on x86.
+ */
+
+typedef struct bench_ctx {
+    uint8_t *frame;
+    uint8_t *copy;
+    uint32_t width, height;
+    size_t len;
+    char *b64;
+    int level, strategy;
+    uint32_t compression;
+    kitty_buf sink;
+    kitty_session ks;
+#ifdef HAVE_ZLIB
+    kitty_zlib kz;
+#endif
+} bench_ctx;
+
+typedef size_t (*bench_fn)(bench_ctx *c);
+
+static uint64_t bench_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void bench_step(bench_ctx *c, const char *name, bench_fn fn)
+{
+    double min_time = min_time_ms * 1e-3, t0, t;
+    uint64_t c0, cycles;
+    size_t out_len = fn(c), n = 0;
+
+    t0 = bench_now();
+    c0 = bench_cycles();
+    do {
+        fn(c);
+        n++;
+    } while ((t = bench_now() - t0) < min_time);
+    cycles = bench_cycles() - c0;
+
+    printf("  %-16s %8.3f GB/s", name, (double)c->len * n / t * 1e-9);
+    if (cycles) {
+        printf(" %7.3f cycles/byte", (double)cycles / ((double)c->len * n));
+    }
+    if (out_len && out_len != c->len) {
+        printf(" %7.2fX", (double)c->len / out_len);
+    }
+    printf("\n");
+}
+
+static size_t bench_flip_step(bench_ctx *c)
+{
+    kitty_flip_buffer_y((uint32_t*)c->frame, c->width, c->height);
+    return c->len;
+}
+
+static size_t bench_copy_flip_step(bench_ctx *c)
+{
+    kitty_copy_flip(c->copy, c->frame, c->width * 4, c->height);
+    return c->len;
+}
+
+static size_t bench_pack_rgb_step(bench_ctx *c)
+{
+    kitty_pack_rgb_flip(c->copy, c->frame, c->width, c->height);
+    return c->len;
+}
+
+static size_t bench_base64_step(bench_ctx *c)
+{
+    return base64_encode(c->len, c->frame, ((c->len + 2) / 3) * 4 + 1,
+        c->b64);
+}
+
+static size_t bench_send_step(bench_ctx *c)
+{
+    c->sink.len = 0;
+    c->ks.sink = &c->sink;
+    c->ks.compression = c->compression;
+    kitty_send_rgba(&c->ks, 'T', 1, c->frame, c->width, c->height);
+    c->ks.sink = NULL;
+    return c->sink.len;
+}
+
+/* the frame read bottom up by the encoders, in place of flip y and send */
+static size_t bench_send_flip_step(bench_ctx *c)
+{
+    c->sink.len = 0;
+    c->ks.sink = &c->sink;
+    c->ks.compression = c->compression;
+    kitty_send_image_flip(&c->ks, 'T', 1, kitty_format_rgba, c->frame,
+        c->width, c->height);
+    c->ks.sink = NULL;
+    return c->sink.len;
+}
+
+#ifdef HAVE_ZLIB
+static size_t bench_zlib_step(bench_ctx *c)
+{
+    kitty_zlib *kz = &c->kz;
+
+    if (kitty_zlib_reset(kz, c->level, MAX_WBITS, c->strategy) ||
+        kitty_buf_reserve(&kz->out, deflateBound(&kz->s, c->len)) < 0) {
+        return 0;
+    }
+    kz->s.avail_in = c->len;
+    kz->s.next_in = c->frame;
+    kz->s.avail_out = kz->out.cap;
+    kz->s.next_out = kz->out.data;
+    if (deflate(&kz->s, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return kz->s.total_out;
+}
+#endif
+
+static void bench_frame_steps(bench_ctx *c)
+{
+    static const struct { const char *name; uint32_t compression; } sends[] = {
+        { "send none", kitty_compress_none },
+        { "send speed", kitty_compress_speed },
+        { "send rle", kitty_compress_rle },
+        { "send rgba", kitty_compress_rgba },
+    };
+    char name[32];
+
+    bench_step(c, "base64", bench_base64_step);
+#ifdef HAVE_ZLIB
+    static const struct { const char *name; int strategy; } strategies[] = {
+        { "filtered", Z_FILTERED },
+        { "huffman", Z_HUFFMAN_ONLY },
+        { "rle", Z_RLE },
+    };
+    c->strategy = Z_DEFAULT_STRATEGY;
+    for (c->level = Z_BEST_SPEED; c->level <= Z_BEST_COMPRESSION; c->level++) {
+        snprintf(name, sizeof(name), "zlib -%d", c->level);
+        bench_step(c, name, bench_zlib_step);
+    }
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+        c->level = Z_BEST_SPEED;
+        c->strategy = strategies[i].strategy;
+        snprintf(name, sizeof(name), "zlib -1 %s", strategies[i].name);
+        bench_step(c, name, bench_zlib_step);
+    }
+#endif
+    for (size_t i = 0; i < sizeof(sends) / sizeof(sends[0]); i++) {
+        c->compression = sends[i].compression;
+        bench_step(c, sends[i].name, bench_send_step);
+        snprintf(name, sizeof(name), "%s flip", sends[i].name);
+        bench_step(c, name, bench_send_flip_step);
+    }
+    bench_step(c, "copy flip", bench_copy_flip_step);
+    bench_step(c, "pack rgb flip", bench_pack_rgb_step);
+    /* the in place flip runs last as it leaves the frame either way up */
+    bench_step(c, "flip y", bench_flip_step);
+}
+
+static void bench_frames()
+{
+    bench_ctx c = { 0 };
+
+    kitty_session_init(&c.ks, kitty_compress_none);
+#ifdef HAVE_ZLIB
+    kitty_zlib_init(&c.kz);
+#endif
+    for (uint32_t dim = 64; dim <= max_frame; dim *= 4) {
+        c.width = c.height = dim;
+        c.len = (size_t)dim * dim * 4;
+        if (!(c.frame = malloc(c.len)) || !(c.copy = malloc(c.len)) ||
+            !(c.b64 = malloc(((c.len + 2) / 3) * 4 + 1))) {
+            fprintf(stderr, "Alloc frame buffer failed!\n");
+            exit(1);
+        }
+        for (uint kind = 0; kind < 2; kind++) {
+            if (kind == 0) {
+                bench_frame(c.frame, dim, dim);
+            } else {
+                bench_gears(c.frame, dim, dim, 0.f);
+            }
+            printf("frame %-6s %ux%u\n", kind ? "gears" : "discs", dim, dim);
+            bench_frame_steps(&c);
+        }
+        free(c.frame);
+        free(c.copy);
+        free(c.b64);
+    }
+#ifdef HAVE_ZLIB
+    kitty_zlib_destroy(&c.kz);
+#endif
+    kitty_buf_destroy(&c.sink);
+    kitty_session_destroy(&c.ks);
+}
+
+/*
+ * pin to one core so the timings are not split across cores, and keep it
+ * busy for a while so the clock has ramped up before the first timing.
+ */
+static void bench_setup(const uint8_t *in, size_t len)
+{
+    cpu_set_t set;
+    size_t out_len = ((len + 2) / 3) * 4 + 1;
+    char *out = malloc(out_len);
+
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "warning: can not pin to cpu %d\n", cpu);
+    } else {
+        printf("pinned to cpu %d\n", cpu);
+    }
+
+    double t0 = bench_now();
+    while (bench_now() - t0 < warmup_ms * 1e-3) {
+        base64_encode(len, in, out_len, out);
+    }
+    free(out);
+}
+
+/*
+ * a burst of queued terminal input: image responses with a key after
+ * every 100th and an error every 250th, as when acks back up behind a
+ * slow render loop.
+ */
+enum { burst_responses = 1000 };
+
+typedef struct bench_events {
+    size_t acks, errors, keys;
+} bench_events;
+
+static size_t bench_burst(char *buf, size_t len)
+{
+    size_t o = 0;
+    for (uint i = 1; i <= burst_responses; i++) {
+        o += snprintf(buf + o, len - o, "\x1B_Gi=%u;%s\x1B\\", i,
+            i % 250 == 0 ? "ENOENT:no such image" : "OK");
+        if (i % 100 == 0) buf[o++] = 'x';
+    }
+    return o;
+}
+
+static void bench_count_event(kitty_event *ev, void *arg)
+{
+    bench_events *e = (bench_events*)arg;
+    switch (ev->type) {
+    case kitty_event_ack: e->acks++; break;
+    case kitty_event_error: e->errors++; break;
+    case kitty_event_key: e->keys++; break;
+    }
+}
+
+/*
+ * check the input parser sees every event in the burst, both when it is
+ * read at once and when every sequence is split across reads.
+ */
+static int bench_input_verify(const char *burst, size_t len)
+{
+    int fds[2], fail = 0;
+    size_t steps[3] = { len, 7, 1 };
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    for (size_t i = 0; i < 3; i++) {
+        size_t step = steps[i];
+        kitty_input ki = { 0 };
+        bench_events e = { 0 };
+        for (size_t o = 0; o < len; o += step) {
+            size_t n = o + step < len ? step : len - o;
+            if (write(fds[1], burst + o, n) != (ssize_t)n) abort();
+            kitty_input_read(&ki, fds[0], bench_count_event, &e);
+        }
+        if (e.acks != burst_responses - 4 || e.errors != 4 || e.keys != 10) {
+            fprintf(stderr, "error: input parser saw %zu acks %zu errors "
+                "%zu keys reading %zu bytes at a time\n",
+                e.acks, e.errors, e.keys, step);
+            fail++;
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return fail;
+}
+
+/*
+ * the previous response parser, which read up to 255 bytes at a time and
+ * only looked for the first image response in them. kept for comparison.
+ */
+typedef struct line { size_t r; char buf[256]; } line;
+
+static int bench_parse_response(line l)
+{
+    /*
+     * parse kitty response of the form: "\x1B_Gi=<image_id>;OK\x1B\\"
+     *
+     * NOTE: a keypress can be present before or after the data
+     */
+    if (l.r < 1) {
+        return -1;
+    }
+    char *esc = strchr(l.buf, '\x1B');
+    if (!esc) {
+        return -1;
+    }
+    ptrdiff_t offset = (esc - l.buf) + 1;
+    int iid = 0, n = 0;
+    int r = sscanf(l.buf+offset, "_Gi=%d;OK%n", &iid, &n);
+    if (r != 1 || n == 0) {
+        return -1;
+    }
+    return iid;
+}
+
+/*
+ * time draining the burst from a pipe with the incremental parser, and
+ * with the previous one response per 255 byte read.
+ */
+static void bench_input(const char *burst, size_t len)
+{
+    kitty_input ki = { 0 };
+    bench_events e = { 0 };
+    size_t legacy_acks = 0, legacy_reads = 0;
+    double t_input = 0, t_legacy = 0, t;
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return;
+    }
+    for (uint j = 0; j < iterations; j++) {
+        if (write(fds[1], burst, len) != (ssize_t)len) abort();
+        t = bench_now();
+        kitty_input_read(&ki, fds[0], bench_count_event, &e);
+        t_input += bench_now() - t;
+
+        if (write(fds[1], burst, len) != (ssize_t)len) abort();
+        t = bench_now();
+        for (size_t o = 0; o < len; legacy_reads++) {
+            line l = { 0, { 0 } };
+            ssize_t r = read(fds[0], l.buf, sizeof(l.buf) - 1);
+            if (r <= 0) break;
+            l.r = r;
+            o += r;
+            legacy_acks += bench_parse_response(l) > 0;
+        }
+        t_legacy += bench_now() - t;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("input parser       %8.1f ns/response %5.1f%% responses seen\n",
+        t_input * 1e9 / ((double)burst_responses * iterations),
+        (e.acks + e.errors) * 100. / ((double)burst_responses * iterations));
+    printf("input legacy       %8.1f ns/response %5.1f%% responses seen"
+        " (%zu reads)\n",
+        t_legacy * 1e9 / ((double)burst_responses * iterations),
+        legacy_acks * 100. / ((double)burst_responses * iterations),
+        legacy_reads / (iterations ? iterations : 1));
+}
+
+/*
+ * help text
+ */
+static void print_help(int argc, char **argv)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -s, --size <bytes>                 input size (default %zu)\n"
+        "  -n, --iterations <integer>         iterations per variant (default %u)\n"
+        "  -m, --max-frame <pixels>           largest frame width, 0 for none (default %u)\n"
+        "  -t, --min-time <ms>                minimum time per frame step (default %u)\n"
+        "  -w, --warmup <ms>                  warmup before timing (default %u)\n"
+        "  -c, --cpu <integer>                cpu to pin to (default current)\n"
+        "  -h, --help                         command line help\n",
+        argv[0], size, iterations, max_frame, min_time_ms, warmup_ms);
+}
+
+/*
+ * command-line option parsing
+ */
+
+static int check_param(int cond, const char *param)
+{
+    if (cond) {
+        printf("error: %s requires parameter\n", param);
+    }
+    return (help = cond);
+}
+
+static int match_opt(const char *arg, const char *opt, const char *longopt)
+{
+    return strcmp(arg, opt) == 0 || strcmp(arg, longopt) == 0;
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int i = 1;
+    while (i < argc) {
+        if (match_opt(argv[i], "-s", "--size")) {
+            if (check_param(++i == argc, "--size")) break;
+            size = strtoull(argv[i++], NULL, 0);
+        } else if (match_opt(argv[i], "-n", "--iterations")) {
+            if (check_param(++i == argc, "--iterations")) break;
+            iterations = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-m", "--max-frame")) {
+            if (check_param(++i == argc, "--max-frame")) break;
+            max_frame = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-t", "--min-time")) {
+            if (check_param(++i == argc, "--min-time")) break;
+            min_time_ms = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-w", "--warmup")) {
+            if (check_param(++i == argc, "--warmup")) break;
+            warmup_ms = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-c", "--cpu")) {
+            if (check_param(++i == argc, "--cpu")) break;
+            cpu = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-h", "--help")) {
+            help++;
+            i++;
+        } else {
+            fprintf(stderr, "error: unknown option: %s\n", argv[i]);
+            help++;
+            break;
+        }
+    }
+
+    if (help) {
+        print_help(argc, argv);
+        exit(1);
+    }
+}
+
+/*
+ * entry point
+ */
+int main(int argc, char **argv)
+{
+    uint8_t *in;
+
+    parse_options(argc, argv);
+
+    if (!(in = malloc(size))) {
+        fprintf(stderr, "Alloc input buffer failed!\n");
+        exit(1);
+    }
+    bench_fill(in, size);
+    bench_setup(in, size);
+
+    if (bench_base64_verify(in, size)) {
+        exit(1);
+    }
+    bench_base64(in, size);
+
+    if (bench_tile_hash_verify(in, size)) {
+        exit(1);
+    }
+    bench_tile_hash(in, size);
+
+#ifdef HAVE_ZLIB
+    if (bench_pixel_deflate_verify(in, size)) {
+        exit(1);
+    }
+    bench_pixel_deflate(size);
+#endif
+
+    char burst[burst_responses * 48];
+    size_t burst_len = bench_burst(burst, sizeof(burst));
+    if (bench_input_verify(burst, burst_len)) {
+        exit(1);
+    }
+    bench_input(burst, burst_len);
+
+    bench_frames();
+
+    free(in);
+    return 0;
+}
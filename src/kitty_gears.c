@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -52,6 +53,15 @@
 static const char* frag_shader_filename = "shaders/gears.fsh";
 static const char* vert_shader_filename = "shaders/gears.vsh";
 
+/*
+ * output pixel formats
+ *
+ * rgba sends the frame as rendered, rgb packs the RGBA frame into RGB
+ * while flipping it, and rgb-osmesa renders RGB directly with OSMesa.
+ */
+
+enum { format_rgba, format_rgb, format_rgb_osmesa };
+
 static uint width = 256, height = 256;
 static uint count = 1000;
 static uint help = 0;
@@ -60,8 +70,50 @@ static uint animation = 1;
 static uint running = 1;
 static uint statistics = 0;
 static uint compression = 0;
+static uint threads = 1;
+static uint pipeline_depth = 0;
+static size_t queue_budget = 1 << 20;
+static char medium = kitty_medium_direct;
+static uint format = format_rgba;
+static uint8_t *packed;
+static uint delta = 0;
+static uint8_t *delta_frames[2];
+static uint delta_cur = 0;
+static size_t delta_count = 0;
+static size_t delta_pixels = 0;
+static size_t delta_rects = 0;
+static size_t cache_budget = 0;
+static kitty_cache cache;
+static uint cache_shown = 0;
+static uint tile_size = 0;
+static uint tiles_x, tiles_y;
+static uint64_t *tile_hashes;
+static size_t tile_frames = 0;
+static size_t tiles_sent = 0;
+static pos tile_cell, tile_origin;
+static uint window = 0;
+static kitty_flow flow;
+static uint64_t loop_ns = 0;
+static uint ack_every = 0;
+static size_t image_errors = 0;
+static char image_error[64];
+static double frame_rate = 0;
+static uint latency_budget = 0;
+static kitty_pacer pacer;
+static const char *record_path;
+static kitty_recorder recorder;
+static size_t record_frames, record_bytes;
+static const char *bench_json;
+static uint64_t run_ns;
+static uint bench = 0;
+static const char *bench_output = "/dev/null";
+static uint size_set = 0, compression_set = 0, compression_mixed = 0;
+static uint64_t anim_ns = 0, anim_last = 0;
+
+enum { cache_first_iid = 32, flow_first_iid = 2 };
 static size_t bytes_rendered = 0;
 static size_t bytes_transferred = 0;
+static kitty_session session;
 
 static GLfloat view_dist = -40.0f;
 static GLfloat view_rotx = 20.f, view_roty = 30.f, view_rotz = 0.f;
@@ -296,11 +348,35 @@ static void reshape(int width, int height )
 
 /*
  * animation update
+ *
+ * the large gear has 20 teeth and the small gears have 10 teeth and turn
+ * at twice the speed, so the picture repeats every 18 degrees. when frames
+ * are cached the angle wraps at this period so repeats are bit identical.
+ *
+ * with a target frame rate the angle follows the clock at the speed of one
+ * degree per default frame interval, so motion stays smooth when frames
+ * are skipped. cached frames snap to whole degrees so that they repeat.
  */
+
+static const GLfloat gear_period = 18.f;
+static const double degrees_per_sec = 100.;
+
 static void animate()
 {
+    if (frame_rate) {
+        uint64_t now = kitty_clock_ns();
+        if (animation && anim_last) anim_ns += now - anim_last;
+        anim_last = now;
+        double a = fmod(anim_ns * 1e-9 * degrees_per_sec,
+            cache_budget ? gear_period : 360.);
+        angle = (GLfloat)(cache_budget ? floor(a) : a);
+        return;
+    }
     if (animation) {
         angle += 1;
+        if (angle >= (cache_budget ? gear_period : 360.f)) {
+            angle = 0.f;
+        }
     }
 }
 
@@ -366,6 +442,27 @@ static void keystroke(int key)
     }
 }
 
+static void acknowledge(int iid, const char *status)
+{
+    if (strcmp(status, "OK") != 0) {
+        image_errors++;
+        snprintf(image_error, sizeof(image_error), "i=%d %s", iid, status);
+    }
+    kitty_pacer_rtt(&pacer, kitty_flow_ack(&flow, iid));
+}
+
+/*
+ * frames are sent quietly (q=1) except every Nth, so the terminal only
+ * responds to sampled frames and to errors. the frame that fills the
+ * window always asks for a response so that it can be released.
+ */
+static uint quiet_frame(uint frame)
+{
+    if (ack_every < 2 || frame % ack_every == 0) return 0;
+    if (window && flow.inflight + 1 >= flow.window) return 0;
+    return 1;
+}
+
 /*
  * help text
  */
@@ -378,10 +475,25 @@ static void print_help(int argc, char **argv)
         "  -s, --frame-size <width>x<height>  window or image size (default %dx%d)\n"
         "  -i, --frame-interval <integer>     interframe delay ms (default %d)\n"
         "  -c, --frame-count <integer>        output frame count limit (default %d)\n"
-        "  -z, --compression                  enable zlib compression\n"
+        "  -z, --compression [auto|rle|rgba]  enable zlib compression\n"
+        "  -j, --threads <integer>            zlib compression threads (default %d)\n"
+        "  -p, --pipeline <integer>           pipelined frames in flight (default off)\n"
+        "  -q, --queue <integer>              output queue budget KiB, 0 blocks (default %zu)\n"
+        "  -w, --window <integer>             unacknowledged images in flight (default off)\n"
+        "  -a, --ack-every <integer>          request a response every N frames (default 1)\n"
+        "  -r, --frame-rate <number>          target frames per second (default off)\n"
+        "  -l, --latency <integer>            acknowledgement latency budget ms (default off)\n"
+        "  -m, --medium <direct|shm|file>     image transmission medium (default direct)\n"
+        "  -f, --format <rgba|rgb|rgb-osmesa> image pixel format (default rgba)\n"
+        "  -d, --delta                        send only the changed rectangles\n"
+        "  -k, --cache <integer>              terminal frame cache budget MiB (default off)\n"
+        "  -t, --tiles <integer>              send changed tiles of this size (default off)\n"
+        "  -o, --record <file>                record the output stream to a file\n"
+        "  -b, --bench-json <file>            write statistics as JSON to a file\n"
+        "  -B, --bench [file]                 headless benchmark, output to a file\n"
         "  -x, --statistics                   print statistics on quit\n"
         "  -h, --help                         command line help\n",
-        argv[0], width, height, millis, count);
+        argv[0], width, height, millis, count, threads, queue_budget >> 10);
 }
 
 /*
@@ -408,6 +520,7 @@ static void parse_options(int argc, char **argv)
         if (match_opt(argv[i], "-s", "--frame-size")) {
             if (check_param(++i == argc, "--frame-size")) break;
             sscanf(argv[i++], "%dx%d", &width, &height);
+            size_set++;
         } else if (match_opt(argv[i], "-c", "--frame-count")) {
             if (check_param(++i == argc, "--frame-count")) break;
             count = atoi(argv[i++]);
@@ -415,11 +528,99 @@ static void parse_options(int argc, char **argv)
             if (check_param(++i == argc, "--frame-interval")) break;
             millis = atoi(argv[i++]);
         } else if (match_opt(argv[i], "-z", "--compression")) {
-            compression += 1;
+            compression_set++;
+            /* the mode is optional, so only consume a known one */
+            if (i + 1 < argc && strcmp(argv[i+1], "auto") == 0) {
+                compression = kitty_compress_auto;
+                i++;
+            } else if (i + 1 < argc && strcmp(argv[i+1], "rle") == 0) {
+                compression = kitty_compress_rle;
+                i++;
+            } else if (i + 1 < argc && strcmp(argv[i+1], "rgba") == 0) {
+                compression = kitty_compress_rgba;
+                i++;
+            } else {
+                /* levels count up, which a named mode can not */
+                compression_mixed += compression >= kitty_compress_rle;
+                compression += 1;
+            }
             i++;
         } else if (match_opt(argv[i], "-9", "--zz")) {
+            compression_set++;
+            compression_mixed += compression >= kitty_compress_rle;
             compression += 2;
             i++;
+        } else if (match_opt(argv[i], "-j", "--threads")) {
+            if (check_param(++i == argc, "--threads")) break;
+            threads = atoi(argv[i++]);
+            if (threads < 1) threads = 1;
+        } else if (match_opt(argv[i], "-p", "--pipeline")) {
+            if (check_param(++i == argc, "--pipeline")) break;
+            pipeline_depth = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-q", "--queue")) {
+            if (check_param(++i == argc, "--queue")) break;
+            queue_budget = strtoull(argv[i++], NULL, 10) << 10;
+        } else if (match_opt(argv[i], "-w", "--window")) {
+            if (check_param(++i == argc, "--window")) break;
+            window = atoi(argv[i++]);
+            if (window > kitty_flow_max) window = kitty_flow_max;
+        } else if (match_opt(argv[i], "-a", "--ack-every")) {
+            if (check_param(++i == argc, "--ack-every")) break;
+            ack_every = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-r", "--frame-rate")) {
+            if (check_param(++i == argc, "--frame-rate")) break;
+            frame_rate = atof(argv[i++]);
+        } else if (match_opt(argv[i], "-l", "--latency")) {
+            if (check_param(++i == argc, "--latency")) break;
+            latency_budget = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-m", "--medium")) {
+            if (check_param(++i == argc, "--medium")) break;
+            if (strcmp(argv[i], "direct") == 0) {
+                medium = kitty_medium_direct;
+            } else if (strcmp(argv[i], "shm") == 0) {
+                medium = kitty_medium_shm;
+            } else if (strcmp(argv[i], "file") == 0) {
+                medium = kitty_medium_file;
+            } else {
+                fprintf(stderr, "error: unknown medium: %s\n", argv[i]);
+                help++;
+            }
+            i++;
+        } else if (match_opt(argv[i], "-f", "--format")) {
+            if (check_param(++i == argc, "--format")) break;
+            if (strcmp(argv[i], "rgba") == 0) {
+                format = format_rgba;
+            } else if (strcmp(argv[i], "rgb") == 0) {
+                format = format_rgb;
+            } else if (strcmp(argv[i], "rgb-osmesa") == 0) {
+                format = format_rgb_osmesa;
+            } else {
+                fprintf(stderr, "error: unknown format: %s\n", argv[i]);
+                help++;
+            }
+            i++;
+        } else if (match_opt(argv[i], "-d", "--delta")) {
+            delta++;
+            i++;
+        } else if (match_opt(argv[i], "-k", "--cache")) {
+            if (check_param(++i == argc, "--cache")) break;
+            cache_budget = strtoull(argv[i++], NULL, 10) << 20;
+        } else if (match_opt(argv[i], "-t", "--tiles")) {
+            if (check_param(++i == argc, "--tiles")) break;
+            tile_size = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-o", "--record")) {
+            if (check_param(++i == argc, "--record")) break;
+            record_path = argv[i++];
+        } else if (match_opt(argv[i], "-B", "--bench")) {
+            /* the output file is optional */
+            bench++;
+            if (i + 1 < argc && argv[i+1][0] != '-') {
+                bench_output = argv[++i];
+            }
+            i++;
+        } else if (match_opt(argv[i], "-b", "--bench-json")) {
+            if (check_param(++i == argc, "--bench-json")) break;
+            bench_json = argv[i++];
         } else if (match_opt(argv[i], "-x", "--statistics")) {
             statistics++;
             i++;
@@ -433,12 +634,525 @@ static void parse_options(int argc, char **argv)
         }
     }
 
+    if (!!delta + !!cache_budget + !!tile_size > 1) {
+        fprintf(stderr, "error: --delta, --cache and --tiles "
+            "can not be combined\n");
+        help++;
+    }
+    /* the latency budget needs acknowledgements to measure */
+    if (latency_budget && !window) {
+        window = 2;
+    }
+    if (latency_budget && frame_rate <= 0) {
+        fprintf(stderr, "error: --latency requires --frame-rate\n");
+        help++;
+    }
+    if (window && (delta || cache_budget || tile_size || pipeline_depth)) {
+        fprintf(stderr, "error: --window can not be combined with --delta, "
+            "--cache, --tiles or --pipeline\n");
+        help++;
+    }
+    if (compression_mixed) {
+        fprintf(stderr, "error: -z and -9 can not follow "
+            "-z auto, rle or rgba\n");
+        help++;
+    }
+    /* auto reads the link estimate the writer thread updates */
+    if (compression == kitty_compress_auto && pipeline_depth) {
+        fprintf(stderr, "error: --compression auto can not be combined "
+            "with --pipeline\n");
+        help++;
+    }
+    if (record_path && medium != kitty_medium_direct) {
+        fprintf(stderr, "error: --record can not be combined with "
+            "--medium shm or file\n");
+        help++;
+    }
+    if (bench && (delta || cache_budget || tile_size || window ||
+            pipeline_depth || frame_rate || record_path ||
+            medium != kitty_medium_direct)) {
+        fprintf(stderr, "error: --bench sends whole frames directly, without "
+            "--delta, --cache, --tiles, --window, --pipeline, --frame-rate, "
+            "--record or --medium\n");
+        help++;
+    }
     if (help) {
         print_help(argc, argv);
         exit(1);
     }
 }
 
+/*
+ * add the time since t0 to a stage of the frame
+ */
+static void stage_span(int stage, uint64_t t0)
+{
+    kitty_stage_add(&session.stages, stage, kitty_clock_ns() - t0);
+}
+
+/*
+ * delta frames
+ *
+ * each flipped frame is kept so the next one can be compared with it.
+ * the first frame is sent whole and later frames only send the rectangles
+ * that changed, editing the image in place with the frame commands.
+ */
+
+enum { delta_iid = 2, delta_max_rects = 16, delta_gap = 8 };
+
+static size_t send_delta(uint8_t *pixels, uint32_t fmt)
+{
+    uint8_t *prev = delta_frames[delta_cur ^ 1];
+    uint8_t *next = delta_frames[delta_cur];
+    size_t pixel_size = fmt >> 3, len = 0, n;
+    kitty_rect rects[delta_max_rects];
+
+    uint64_t t0 = kitty_clock_ns();
+    if (format == format_rgb) {
+        kitty_pack_rgb_flip(next, pixels, width, height);
+    } else {
+        kitty_copy_flip(next, pixels, width * pixel_size, height);
+    }
+    stage_span(kitty_stage_flip, t0);
+
+    if (delta_count++ == 0) {
+        len = kitty_send_image(&session, 'T', delta_iid, fmt, next,
+            width, height);
+        delta_pixels += width * height;
+    } else {
+        n = kitty_diff_rects(rects, delta_max_rects, prev, next, pixel_size,
+            width, height, delta_gap);
+        for (size_t i = 0; i < n; i++) {
+            len += kitty_send_rect(&session, delta_iid, fmt, next, width,
+                rects[i]);
+            delta_pixels += rects[i].w * rects[i].h;
+        }
+        delta_rects += n;
+    }
+
+    delta_cur ^= 1;
+    return len;
+}
+
+/*
+ * send the rendered frame, packing it first if required. the encoders
+ * read the rows bottom up from the frame, so it is only copied when it
+ * is packed to RGB, which flips it at the same time.
+ */
+static size_t send_image(uint8_t *pixels, uint iid)
+{
+    uint64_t t0 = kitty_clock_ns();
+
+    switch (format) {
+    case format_rgb:
+        kitty_pack_rgb_flip(packed, pixels, width, height);
+        stage_span(kitty_stage_flip, t0);
+        return kitty_send_image(&session, 'T', iid, kitty_format_rgb,
+            packed, width, height);
+    case format_rgb_osmesa:
+        return kitty_send_image_flip(&session, 'T', iid, kitty_format_rgb,
+            pixels, width, height);
+    default:
+        return kitty_send_image_flip(&session, 'T', iid, kitty_format_rgba,
+            pixels, width, height);
+    }
+}
+
+/*
+ * frame cache
+ *
+ * frames are hashed as rendered. a frame the terminal already holds is
+ * placed again by id, otherwise it is uploaded under a new id. the
+ * placement of the previously shown image is then removed, leaving its
+ * data in the terminal for later frames.
+ */
+static size_t send_cached(uint8_t *pixels)
+{
+    size_t pixel_size = format == format_rgb_osmesa ? 3 : 4;
+    size_t image_size = (size_t)width * height *
+        (format == format_rgba ? 4 : 3);
+    uint64_t hash = kitty_hash64(pixels, (size_t)width * height * pixel_size);
+    uint32_t id = kitty_cache_lookup(&cache, hash);
+    size_t len = 0;
+
+    /* the shown image is already placed, placing it again adds another */
+    if (id && id == cache_shown) {
+        return 0;
+    } else if (id) {
+        kitty_place_image(&session, id);
+    } else {
+        id = kitty_cache_insert(&session, &cache, hash, image_size);
+        len = send_image(pixels, id);
+    }
+    if (cache_shown && cache_shown != id) {
+        kitty_delete_image(&session, cache_shown, 'i');
+    }
+    kitty_session_flush(&session);
+    cache_shown = id;
+
+    return len;
+}
+
+/*
+ * tiled frames
+ *
+ * the frame is split into square tiles that are separate images placed at
+ * their cell offsets. tiles are hashed straight from the frame buffer and
+ * only the tiles whose hash changed are sent again.
+ */
+
+enum { tile_first_iid = 64 };
+
+static size_t send_tiles(uint8_t *pixels)
+{
+    uint32_t fmt = format == format_rgba ?
+        kitty_format_rgba : kitty_format_rgb;
+    size_t pixel_size = fmt >> 3, len = 0;
+    const uint8_t *frame;
+    ptrdiff_t stride;
+    char keys[96];
+
+    /* tiles are read bottom up from the frame unless it was packed */
+    if (format == format_rgb) {
+        uint64_t t0 = kitty_clock_ns();
+        kitty_pack_rgb_flip(packed, pixels, width, height);
+        stage_span(kitty_stage_flip, t0);
+        frame = packed;
+        stride = width * pixel_size;
+    } else {
+        stride = -(ptrdiff_t)(width * pixel_size);
+        frame = pixels - (ptrdiff_t)(height - 1) * stride;
+    }
+
+    for (uint ty = 0; ty < tiles_y; ty++) {
+        for (uint tx = 0; tx < tiles_x; tx++) {
+            uint i = ty * tiles_x + tx;
+            kitty_rect r = { tx * tile_size, ty * tile_size,
+                tile_size, tile_size };
+            if (r.x + r.w > width) r.w = width - r.x;
+            if (r.y + r.h > height) r.h = height - r.y;
+            uint64_t hash = kitty_tile_hash(frame + r.y * stride +
+                r.x * pixel_size, stride, r.w * pixel_size, r.h);
+            if (tile_frames && tile_hashes[i] == hash) continue;
+            tile_hashes[i] = hash;
+            kitty_session_position(&session,
+                tile_origin.x + r.x / tile_cell.x,
+                tile_origin.y + r.y / tile_cell.y);
+            snprintf(keys, sizeof(keys), "a=T,i=%u,X=%u,Y=%u,C=1",
+                tile_first_iid + i, r.x % tile_cell.x, r.y % tile_cell.y);
+            len += fmt == kitty_format_rgba ?
+                kitty_send_rgba_rect(&session, keys, frame, stride, r) :
+                kitty_send_image_rect(&session, keys, fmt, frame, stride, r);
+            tiles_sent++;
+        }
+    }
+    tile_frames++;
+
+    return len;
+}
+
+static size_t send_frame(uint8_t *pixels, uint iid)
+{
+    if (delta) {
+        return send_delta(pixels, format == format_rgba ?
+            kitty_format_rgba : kitty_format_rgb);
+    } else if (cache_budget) {
+        return send_cached(pixels);
+    } else if (tile_size) {
+        return send_tiles(pixels);
+    } else {
+        return send_image(pixels, iid);
+    }
+}
+
+/*
+ * pipelined render, encode and transmit
+ *
+ * the render thread owns the OSMesa context and draws into a free frame
+ * slot, an encoder thread compresses and base64 encodes it into the
+ * slot output buffer, and a writer thread sends it to the terminal. slots
+ * circulate through bounded queues so the in-flight depth is the number of
+ * slots. a NULL slot is passed down the pipeline to shut it down.
+ */
+
+enum { stage_render, stage_encode, stage_write, stage_count };
+
+static const char* stage_names[stage_count] = { "render", "encode", "write" };
+static uint64_t stage_ns[stage_count];
+static uint64_t elapsed_ns;
+
+typedef struct frame_slot {
+    uint8_t *pixels;
+    kitty_buf out;
+    uint iid;
+    uint quiet;
+    uint64_t render_ns;
+    uint64_t encode_ns;
+} frame_slot;
+
+typedef struct frame_pipeline {
+    kitty_queue free_q;
+    kitty_queue encode_q;
+    kitty_queue write_q;
+    frame_slot *slots;
+    uint depth;
+    pos p;
+    pthread_t encoder;
+    pthread_t writer;
+    uint64_t busy_ns[stage_count];
+} frame_pipeline;
+
+static void* pipeline_encoder(void *arg)
+{
+    frame_pipeline *fp = (frame_pipeline*)arg;
+    frame_slot *slot;
+    size_t len;
+
+    while ((slot = (frame_slot*)kitty_queue_pop(&fp->encode_q))) {
+        uint64_t t0 = kitty_clock_ns();
+        slot->out.len = 0;
+        session.sink = &slot->out;
+        session.quiet = slot->quiet;
+        kitty_session_position(&session, fp->p.x, fp->p.y - height / 18);
+        len = send_frame(slot->pixels, slot->iid);
+        bytes_rendered += (width * height) << 2;
+        bytes_transferred += len;
+        slot->encode_ns = kitty_clock_ns() - t0;
+        fp->busy_ns[stage_encode] += slot->encode_ns;
+        kitty_stage_commit_encode(&session.stages);
+        kitty_queue_push(&fp->write_q, slot);
+    }
+    kitty_queue_push(&fp->write_q, NULL);
+    return NULL;
+}
+
+static void* pipeline_writer(void *arg)
+{
+    frame_pipeline *fp = (frame_pipeline*)arg;
+    frame_slot *slot;
+
+    while ((slot = (frame_slot*)kitty_queue_pop(&fp->write_q))) {
+        uint64_t t0 = kitty_clock_ns();
+        kitty_write_all(&session, session.out_fd, slot->out.data,
+            slot->out.len);
+        uint64_t write_ns = kitty_clock_ns() - t0;
+        fp->busy_ns[stage_write] += write_ns;
+        kitty_stage_commit(&session.stages, kitty_stage_write);
+        if (session.record) {
+            kitty_record_write(session.record, slot->out.data, slot->out.len,
+                (kitty_record_frame) { 0, 0, t0, slot->render_ns,
+                    slot->encode_ns, write_ns });
+        }
+        kitty_queue_push(&fp->free_q, slot);
+    }
+    return NULL;
+}
+
+static int pipeline_init(frame_pipeline *fp, uint depth, pos p)
+{
+    memset(fp, 0, sizeof(frame_pipeline));
+    fp->depth = depth;
+    fp->p = p;
+    if (!(fp->slots = (frame_slot*)calloc(depth, sizeof(frame_slot)))) {
+        return -1;
+    }
+    if (kitty_queue_init(&fp->free_q, depth) < 0 ||
+        kitty_queue_init(&fp->encode_q, depth + 1) < 0 ||
+        kitty_queue_init(&fp->write_q, depth + 1) < 0) {
+        return -1;
+    }
+    for (uint i = 0; i < depth; i++) {
+        if (!(fp->slots[i].pixels = (uint8_t*)malloc(width * height * sizeof(uint)))) {
+            return -1;
+        }
+        kitty_queue_push(&fp->free_q, &fp->slots[i]);
+    }
+    pthread_create(&fp->encoder, NULL, pipeline_encoder, fp);
+    pthread_create(&fp->writer, NULL, pipeline_writer, fp);
+    return 0;
+}
+
+static void pipeline_destroy(frame_pipeline *fp)
+{
+    kitty_queue_push(&fp->encode_q, NULL);
+    pthread_join(fp->encoder, NULL);
+    pthread_join(fp->writer, NULL);
+    session.sink = NULL;
+    for (uint i = 0; i < fp->depth; i++) {
+        free(fp->slots[i].pixels);
+        kitty_buf_destroy(&fp->slots[i].out);
+    }
+    free(fp->slots);
+    kitty_queue_destroy(&fp->free_q);
+    kitty_queue_destroy(&fp->encode_q);
+    kitty_queue_destroy(&fp->write_q);
+}
+
+static uint pipeline_run(OSMesaContext ctx, pos p)
+{
+    frame_pipeline fp;
+    frame_slot *slot;
+    uint64_t t0, t1;
+    uint frame;
+
+    if (pipeline_init(&fp, pipeline_depth, p) < 0) {
+        fprintf(stderr, "Alloc pipeline failed!\n");
+        exit(1);
+    }
+
+    t0 = kitty_clock_ns();
+    for (frame = 0; frame < count && running; frame++)
+    {
+        slot = (frame_slot*)kitty_queue_pop(&fp.free_q);
+        if (frame_rate) {
+            kitty_pacer_wait(&session, &pacer);
+        }
+
+        uint64_t t = kitty_clock_ns();
+        if (!OSMesaMakeCurrent(ctx, slot->pixels, GL_UNSIGNED_BYTE, width, height)) {
+            fprintf(stderr, "OSMesaMakeCurrent failed!\n");
+            exit(1);
+        }
+        draw();
+        glFlush();
+        slot->render_ns = kitty_clock_ns() - t;
+        fp.busy_ns[stage_render] += slot->render_ns;
+        kitty_stage_add(&session.stages, kitty_stage_render, slot->render_ns);
+        kitty_stage_commit(&session.stages, kitty_stage_render);
+        if (frame_rate) {
+            kitty_pacer_cost(&pacer, kitty_clock_ns() - t);
+        }
+
+        slot->iid = 2 + (frame&1);
+        slot->quiet = quiet_frame(frame);
+        kitty_queue_push(&fp.encode_q, slot);
+
+        /* input is drained without waiting, the queues pace the loop */
+        if (!frame_rate) {
+            t = kitty_clock_ns();
+            kitty_poll_events(0);
+            stage_span(kitty_stage_poll, t);
+            kitty_stage_commit(&session.stages, kitty_stage_poll);
+        }
+        animate();
+    }
+    pipeline_destroy(&fp);
+    t1 = kitty_clock_ns();
+
+    memcpy(stage_ns, fp.busy_ns, sizeof(stage_ns));
+    elapsed_ns = t1 - t0;
+
+    return frame;
+}
+
+/*
+ * benchmark report
+ *
+ * the configuration, throughput and stage latency percentiles as JSON,
+ * with times in milliseconds.
+ */
+static const char* compression_name(uint c)
+{
+    switch (c) {
+    case kitty_compress_none: return "none";
+    case kitty_compress_speed: return "speed";
+    case kitty_compress_best: return "best";
+    case kitty_compress_rle: return "rle";
+    case kitty_compress_auto: return "auto";
+    case kitty_compress_rgba: return "rgba";
+    default: return c < kitty_compress_rle ? "best" : "unknown";
+    }
+}
+
+/*
+ * one run as a JSON object, each line indented by pad. bench runs add the
+ * pixel checksum of every frame.
+ */
+static void print_bench_run(FILE *f, const char *pad, uint frames,
+    const uint64_t *checksums)
+{
+    static const char *format_names[] = { "rgba", "rgb", "rgb-osmesa" };
+    double sec = run_ns / 1e9;
+
+    fprintf(f, "{\n%s  \"config\": {\n", pad);
+    fprintf(f, "%s    \"width\": %u,\n", pad, width);
+    fprintf(f, "%s    \"height\": %u,\n", pad, height);
+    fprintf(f, "%s    \"frame_count\": %u,\n", pad, count);
+    fprintf(f, "%s    \"frame_interval_ms\": %u,\n", pad, millis);
+    fprintf(f, "%s    \"compression\": \"%s\",\n", pad,
+        compression_name(compression));
+    fprintf(f, "%s    \"threads\": %u,\n", pad, threads);
+    fprintf(f, "%s    \"pipeline\": %u,\n", pad, pipeline_depth);
+    fprintf(f, "%s    \"queue_kib\": %zu,\n", pad, queue_budget >> 10);
+    fprintf(f, "%s    \"medium\": \"%s\",\n", pad,
+        session.medium == kitty_medium_shm ? "shm" :
+        session.medium == kitty_medium_file ? "file" : "direct");
+    fprintf(f, "%s    \"format\": \"%s\",\n", pad, format_names[format]);
+    fprintf(f, "%s    \"delta\": %u,\n", pad, !!delta);
+    fprintf(f, "%s    \"cache_mib\": %zu,\n", pad, cache_budget >> 20);
+    fprintf(f, "%s    \"tiles\": %u,\n", pad, tile_size);
+    fprintf(f, "%s    \"window\": %u,\n", pad, window);
+    fprintf(f, "%s    \"ack_every\": %u,\n", pad, ack_every);
+    fprintf(f, "%s    \"frame_rate\": %.3f,\n", pad, frame_rate);
+    fprintf(f, "%s    \"latency_ms\": %u\n%s  },\n", pad, latency_budget,
+        pad);
+    fprintf(f, "%s  \"throughput\": {\n", pad);
+    fprintf(f, "%s    \"frames\": %u,\n", pad, frames);
+    fprintf(f, "%s    \"elapsed_sec\": %.6f,\n", pad, sec);
+    fprintf(f, "%s    \"frames_per_sec\": %.3f,\n", pad,
+        sec > 0 ? frames / sec : 0.);
+    fprintf(f, "%s    \"bytes_rendered\": %zu,\n", pad, bytes_rendered);
+    fprintf(f, "%s    \"bytes_transferred\": %zu,\n", pad,
+        bytes_transferred);
+    fprintf(f, "%s    \"transfer_mb_per_sec\": %.3f,\n", pad,
+        sec > 0 ? bytes_transferred / sec / 1e6 : 0.);
+    fprintf(f, "%s    \"compression_ratio\": %.3f,\n", pad,
+        bytes_transferred ? (double)bytes_rendered / bytes_transferred : 0.);
+    fprintf(f, "%s    \"frames_dropped\": %zu,\n", pad,
+        (size_t)session.out_dropped);
+    fprintf(f, "%s    \"image_errors\": %zu\n%s  },\n", pad, image_errors,
+        pad);
+    fprintf(f, "%s  \"stages\": {", pad);
+    for (uint i = 0, n = 0; i < kitty_stage_count; i++) {
+        kitty_hist *h = &session.stages.hist[i];
+        if (!h->count) continue;
+        fprintf(f, "%s\n%s    \"%s\": { \"count\": %zu, \"mean_ms\": %.6f, "
+            "\"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f, "
+            "\"max_ms\": %.6f }", n++ ? "," : "", pad, kitty_stage_names[i],
+            (size_t)h->count, kitty_hist_mean(h) / 1e6,
+            kitty_hist_percentile(h, 50) / 1e6,
+            kitty_hist_percentile(h, 90) / 1e6,
+            kitty_hist_percentile(h, 99) / 1e6, h->max / 1e6);
+    }
+    fprintf(f, "\n%s  }", pad);
+    if (checksums) {
+        fprintf(f, ",\n%s  \"checksums\": [", pad);
+        for (uint i = 0; i < frames; i++) {
+            if (i % 4 == 0) {
+                fprintf(f, "%s\n%s    ", i ? "," : "", pad);
+            } else {
+                fprintf(f, ", ");
+            }
+            fprintf(f, "\"%016llx\"", (unsigned long long)checksums[i]);
+        }
+        fprintf(f, "\n%s  ]", pad);
+    }
+    fprintf(f, "\n%s}", pad);
+}
+
+static int write_bench_json(const char *path, uint frames)
+{
+    FILE *f;
+
+    if (!(f = fopen(path, "w"))) {
+        return -1;
+    }
+    print_bench_run(f, "", frames, NULL);
+    fprintf(f, "\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
 /*
  * kitty_gears main loop
  */
@@ -451,8 +1165,9 @@ static int kitty_gears(int argc, char *argv[])
     size_t len;
     pos p;
 
-    /* Create an RGBA-mode context */
-    if (!(ctx = OSMesaCreateContextExt( OSMESA_RGBA, 16, 0, 0, NULL))) {
+    /* Create an RGBA-mode or RGB-mode context */
+    GLenum osmesa_format = format == format_rgb_osmesa ? OSMESA_RGB : OSMESA_RGBA;
+    if (!(ctx = OSMesaCreateContextExt( osmesa_format, 16, 0, 0, NULL))) {
         fprintf(stderr, "OSMesaCreateContext failed!\n");
         return 0;
     }
@@ -463,6 +1178,21 @@ static int kitty_gears(int argc, char *argv[])
         return 0;
     }
 
+    /* Allocate the RGB packing buffer */
+    if (format == format_rgb &&
+        !(packed = (uint8_t*)malloc(width * height * 3))) {
+        fprintf(stderr, "Alloc packing buffer failed!\n");
+        return 0;
+    }
+
+    /* Allocate the delta frame buffers */
+    for (uint i = 0; delta && i < 2; i++) {
+        if (!(delta_frames[i] = (uint8_t*)malloc(width * height * sizeof(uint)))) {
+            fprintf(stderr, "Alloc delta buffer failed!\n");
+            return 0;
+        }
+    }
+
     /* Bind the buffer to the context and make it current */
     if (!OSMesaMakeCurrent( ctx, buffer, GL_UNSIGNED_BYTE, width, height)) {
         fprintf(stderr, "OSMesaMakeCurrent failed!\n");
@@ -470,6 +1200,10 @@ static int kitty_gears(int argc, char *argv[])
     }
 
     kitty_key_callback(keystroke);
+    kitty_ack_callback(acknowledge);
+    kitty_session_init(&session, compression);
+    session.threads = threads;
+    kitty_cache_init(&cache, cache_budget, cache_first_iid);
 
     init();
     reshape(width, height);
@@ -480,27 +1214,120 @@ static int kitty_gears(int argc, char *argv[])
     p = kitty_get_position();
     kitty_hide_cursor();
 
+    /* tiles are placed at cell offsets so need the cell size */
+    if (tile_size) {
+        tile_cell = kitty_get_cell_size(1000);
+        tile_origin = (pos) { p.x, p.y - (int)lh };
+        tiles_x = (width + tile_size - 1) / tile_size;
+        tiles_y = (height + tile_size - 1) / tile_size;
+        if (!tile_cell.x || !tile_cell.y) {
+            fprintf(stderr, "error: unknown cell size, tiles disabled\n");
+            tile_size = 0;
+        } else if (!(tile_hashes = (uint64_t*)calloc(tiles_x * tiles_y,
+                sizeof(uint64_t)))) {
+            fprintf(stderr, "Alloc tile hashes failed!\n");
+            return 0;
+        }
+    }
+
+    /* use shared memory or files if the terminal can read them */
+    if (medium != kitty_medium_direct) {
+        session.medium = medium;
+        if (!kitty_query_medium(&session, 1000)) {
+            session.medium = kitty_medium_direct;
+        }
+    }
+
+    /* only the frames are recorded, not the terminal queries */
+    if (record_path) {
+        if (kitty_record_open(&recorder, record_path) < 0) {
+            fprintf(stderr, "error: can not open %s\n", record_path);
+            return 0;
+        }
+        session.record = &recorder;
+    }
+
     /* loop displaying frames */
-    for(frame = 0; frame < count && running; frame++)
+    if (!pipeline_depth && queue_budget) {
+        kitty_out_init(&session, queue_budget);
+    }
+    if (window) {
+        kitty_flow_init(&flow, window, flow_first_iid);
+    }
+    if (frame_rate) {
+        kitty_pacer_init(&pacer, frame_rate, latency_budget);
+    }
+    if (window || frame_rate) {
+        loop_ns = kitty_clock_ns();
+    }
+    /* leave out the medium query sent before the first frame */
+    memset(&session.stages, 0, sizeof(session.stages));
+    run_ns = kitty_clock_ns();
+    if (pipeline_depth) {
+        frame = pipeline_run(ctx, p);
+    }
+    else for(frame = 0; frame < count && running; frame++)
     {
+        /* wait for the terminal to acknowledge an image in flight */
+        if (window) {
+            kitty_flow_wait(&session, &flow, 1000);
+        }
+        if (frame_rate) {
+            kitty_pacer_wait(&session, &pacer);
+        }
+
+        uint64_t t0 = kitty_clock_ns();
         draw();
         glFlush();
+        session.render_ns = kitty_clock_ns() - t0;
+        kitty_stage_add(&session.stages, kitty_stage_render, session.render_ns);
+        kitty_stage_commit(&session.stages, kitty_stage_render);
 
-        /* flip buffer and output to kitty as base64 RGBA data*/
-        uint iid = 2 + (frame&1);
-        kitty_set_position(p.x, p.y-lh);
-        kitty_flip_buffer_y((uint*)buffer, width, height);
-        len = kitty_send_rgba('T', iid, compression, buffer, width, height);
+        /*
+         * output the buffer to kitty as base64 RGBA data. frames that
+         * are waiting for an acknowledgement can not be dropped.
+         */
+        uint iid = window ? kitty_flow_next_id(&flow) : 2 + (frame&1);
+        session.quiet = quiet_frame(frame);
+        kitty_frame_begin(&session,
+            !delta && !cache_budget && !tile_size && !window);
+        kitty_session_position(&session, p.x, p.y-lh);
+        len = send_frame(buffer, iid);
+        if (window) {
+            kitty_flow_sent(&flow, iid, session.quiet);
+        }
+        kitty_frame_end(&session);
+        if (frame_rate) {
+            kitty_pacer_cost(&pacer, kitty_clock_ns() - t0);
+        }
 
         bytes_rendered += (width * height) << 2;
         bytes_transferred += len;
 
-        kitty_poll_events(millis);
+        uint64_t t1 = kitty_clock_ns();
+        kitty_session_wait(&session, window || frame_rate ? 0 : millis);
+        stage_span(kitty_stage_poll, t1);
+        kitty_stage_commit(&session.stages, kitty_stage_poll);
         animate();
     }
+    if (loop_ns && !pipeline_depth) {
+        loop_ns = kitty_clock_ns() - loop_ns;
+    } else {
+        loop_ns = 0;
+    }
 
-    /* drain kitty responses */
+    /* finish queued output then drain kitty responses */
+    kitty_out_finish(&session);
+    run_ns = kitty_clock_ns() - run_ns;
     kitty_poll_events(millis);
+    if (session.record) {
+        record_frames = recorder.index.len / sizeof(kitty_record_frame);
+        record_bytes = recorder.offset - sizeof(kitty_record_header);
+        if (kitty_record_close(&recorder) < 0) {
+            fprintf(stderr, "error: can not write %s\n", record_path);
+        }
+        session.record = NULL;
+    }
 
     /* restore cursor position then show cursor */
     kitty_show_cursor();
@@ -518,20 +1345,308 @@ static int kitty_gears(int argc, char *argv[])
             float efficiency = (1.f - 1.f/factor)*100.f;
             printf("efficiency      = %5.2f%% (%5.2fX)\n", efficiency, factor);
         }
+        if (session.compress_frames) {
+            printf("compress time   = %7.3f (ms/frame)\n",
+                session.compress_ns / 1e6 / session.compress_frames);
+        }
+        if (compression == kitty_compress_auto) {
+            kitty_auto *ka = &session.autoc;
+            printf("compress auto   = %zu (none) %zu (speed) %zu (rle) "
+                "%zu (best) %zu (rgba)\n", (size_t)ka->chosen[0],
+                (size_t)ka->chosen[1], (size_t)ka->chosen[2],
+                (size_t)ka->chosen[3], (size_t)ka->chosen[4]);
+            printf("link speed      = %7.2f (MB/sec)\n",
+                ka->link_ns_per_byte > 0 ? 1e3 / ka->link_ns_per_byte : 0.);
+        }
+        if (medium != kitty_medium_direct) {
+            printf("medium          = %s%s\n",
+                session.medium == kitty_medium_shm ? "shm" :
+                session.medium == kitty_medium_file ? "file" : "direct",
+                medium != session.medium || session.medium_fallbacks ?
+                " (fallback)" : "");
+        }
+        if (session.medium == kitty_medium_file) {
+            printf("files in flight = %u (peak) %u (sent direct)\n",
+                session.file_peak, session.file_overflows);
+        }
+        if (session.write_calls) {
+            printf("write syscalls  = %7.2f (calls/frame) %7.0f (bytes/call)\n",
+                frame ? (double)session.write_calls / frame : 0.,
+                (double)session.write_bytes / session.write_calls);
+        }
+        if (session.out_peak) {
+            printf("frames dropped  = %zu (queue high water %zu bytes)\n",
+                (size_t)session.out_dropped, session.out_peak);
+        }
+        if (window) {
+            printf("ack round trip  = %7.3f (ms avg) %7.3f (min) %7.3f (max)\n",
+                flow.acks ? flow.rtt_sum / 1e6 / flow.acks : 0.,
+                flow.acks ? flow.rtt_min / 1e6 : 0., flow.rtt_max / 1e6);
+            printf("ack window      = %u (images) %zu (acks) %zu (lost)\n",
+                flow.window, (size_t)flow.acks, (size_t)flow.lost);
+        }
+        if (frame_rate) {
+            printf("frame pacing    = %7.3f (ms target) %7.3f (ms period) "
+                "%zu (skipped)\n", pacer.target_ns / 1e6,
+                pacer.period_ns / 1e6, (size_t)pacer.skipped);
+            printf("frame time      = %7.3f (p50) %7.3f (p90) %7.3f (p99) "
+                "%7.3f (max ms)\n",
+                kitty_percentile(pacer.intervals, pacer.count, 50) / 1e6,
+                kitty_percentile(pacer.intervals, pacer.count, 90) / 1e6,
+                kitty_percentile(pacer.intervals, pacer.count, 99) / 1e6,
+                kitty_percentile(pacer.intervals, pacer.count, 100) / 1e6);
+            printf("frame jitter    = %7.3f (p50) %7.3f (p90) %7.3f (p99) "
+                "%7.3f (max ms)\n",
+                kitty_percentile(pacer.jitter, pacer.count, 50) / 1e6,
+                kitty_percentile(pacer.jitter, pacer.count, 90) / 1e6,
+                kitty_percentile(pacer.jitter, pacer.count, 99) / 1e6,
+                kitty_percentile(pacer.jitter, pacer.count, 100) / 1e6);
+        }
+        if (loop_ns) {
+            printf("frame rate      = %7.2f (frames/sec)\n",
+                frame * 1e9 / loop_ns);
+        }
+        if (record_path) {
+            printf("recorded        = %zu (frames) %zu (bytes)\n",
+                record_frames, record_bytes);
+        }
+        if (ack_every > 1 || image_errors) {
+            printf("image errors    = %zu%s%s\n", image_errors,
+                image_errors ? " last " : "", image_error);
+        }
+        if (delta_count) {
+            printf("delta area      = %5.1f%% (%5.2f rects/frame)\n",
+                delta_pixels * 100. / ((size_t)width * height * delta_count),
+                delta_count > 1 ? (double)delta_rects / (delta_count - 1) : 0.);
+        }
+        if (cache_budget) {
+            printf("frame cache     = %zu (hits) %zu (misses) %zu (evictions)\n",
+                cache.hits, cache.misses, cache.evictions);
+            printf("cache resident  = %zu (images) %zu (bytes)\n",
+                cache.count, cache.bytes);
+        }
+        if (tile_frames) {
+            printf("tiles sent      = %5.1f%% (%zu tiles)\n",
+                tiles_sent * 100. / (tile_frames * tiles_x * tiles_y),
+                tiles_sent);
+        }
+        for (uint i = 0; i < kitty_stage_count; i++) {
+            kitty_hist *h = &session.stages.hist[i];
+            char label[32];
+            if (!h->count) continue;
+            snprintf(label, sizeof(label), "latency %s",
+                kitty_stage_names[i]);
+            printf("%-15s = %7.3f (p50) %7.3f (p90) %7.3f (p99) "
+                "%7.3f (max ms)\n", label,
+                kitty_hist_percentile(h, 50) / 1e6,
+                kitty_hist_percentile(h, 90) / 1e6,
+                kitty_hist_percentile(h, 99) / 1e6, h->max / 1e6);
+        }
+        if (elapsed_ns) {
+            for (uint i = 0; i < stage_count; i++) {
+                printf("%-6s stage    = %7.3f (ms/frame) %5.1f%% utilisation\n",
+                    stage_names[i], frame ? stage_ns[i] / 1e6 / frame : 0.,
+                    stage_ns[i] * 100. / elapsed_ns);
+            }
+            printf("frame rate      = %7.2f (frames/sec)\n",
+                frame * 1e9 / elapsed_ns);
+        }
+    }
+
+    if (bench_json && write_bench_json(bench_json, frame) < 0) {
+        fprintf(stderr, "error: can not write %s\n", bench_json);
     }
 
     /* release memory and exit */
+    kitty_cache_destroy(&cache);
+    if (frame_rate) {
+        kitty_pacer_destroy(&pacer);
+    }
+    kitty_session_destroy(&session);
     OSMesaDestroyContext(ctx);
     free(buffer);
+    free(packed);
+    free(delta_frames[0]);
+    free(delta_frames[1]);
+    free(tile_hashes);
     exit(EXIT_SUCCESS);
 }
 
+/*
+ * headless benchmark
+ *
+ * renders the same frames at each size and compression setting, stepping
+ * the gears one degree a frame from the start position, and writes the
+ * output to /dev/null or a file. there is no terminal, so the termios
+ * setup and the terminal queries are skipped. the checksum of the pixels
+ * of each frame shows whether a change alters the rendered output, and
+ * the checksum of the frame pixel checksums is reported for each run.
+ */
+
+static const uint bench_sizes[][2] = {
+    { 256, 256 }, { 512, 512 }, { 1024, 1024 }
+};
+
+static const uint bench_compressions[] = {
+    kitty_compress_none, kitty_compress_speed, kitty_compress_rle,
+    kitty_compress_rgba, kitty_compress_best
+};
+
+static int bench_run(uint8_t *buffer, uint64_t *checksums)
+{
+    size_t pixel_size = format == format_rgb_osmesa ? 3 : 4;
+    size_t image_size = (size_t)width * height * (format == format_rgba ? 4 : 3);
+    size_t rendered_size = (size_t)width * height * pixel_size;
+    uint64_t hash_ns = 0, checksum = 0;
+    uint frame;
+    int fd;
+
+    if ((fd = open(bench_output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "error: can not open %s\n", bench_output);
+        return -1;
+    }
+
+    kitty_session_init(&session, compression);
+    session.threads = threads;
+    session.out_fd = fd;
+    if (queue_budget) {
+        kitty_out_init(&session, queue_budget);
+    }
+    angle = 0.f;
+    bytes_rendered = bytes_transferred = 0;
+
+    run_ns = kitty_clock_ns();
+    for (frame = 0; frame < count; frame++) {
+        uint64_t t0 = kitty_clock_ns();
+        draw();
+        glFlush();
+        stage_span(kitty_stage_render, t0);
+        kitty_stage_commit(&session.stages, kitty_stage_render);
+
+        /* the checksum is left out of the timings */
+        uint64_t t1 = kitty_clock_ns();
+        checksums[frame] = kitty_hash64(buffer, rendered_size);
+        checksum = kitty_hash_mix(checksum, checksums[frame]);
+        hash_ns += kitty_clock_ns() - t1;
+
+        kitty_frame_begin(&session, 0);
+        kitty_session_position(&session, 1, 1);
+        bytes_transferred += send_frame(buffer, 2 + (frame & 1));
+        kitty_frame_end(&session);
+        bytes_rendered += rendered_size;
+        animate();
+    }
+    kitty_out_finish(&session);
+    run_ns = kitty_clock_ns() - run_ns - hash_ns;
+
+    /* each stage as MB/sec of the bytes it handles */
+    kitty_hist *h = session.stages.hist;
+    double mb = (double)count / 1e6, sec = run_ns / 1e9;
+    double stage_bytes[kitty_stage_count] = {
+        (double)rendered_size, (double)rendered_size, (double)image_size,
+        (double)bytes_transferred / count,
+        (double)session.write_bytes / count, 0
+    };
+    printf("%4ux%-4u %-6s %6u %9.2f %7.2fX", width, height,
+        compression_name(compression), frame, frame / sec,
+        (double)image_size * count / bytes_transferred);
+    for (uint i = 0; i < kitty_stage_poll; i++) {
+        printf(" %8.1f", h[i].sum ? stage_bytes[i] * mb / (h[i].sum / 1e9) : 0.);
+    }
+    printf(" %016llx\n", (unsigned long long)checksum);
+    fflush(stdout);
+
+    kitty_session_destroy(&session);
+    close(fd);
+    return 0;
+}
+
+static int kitty_bench(int argc, char *argv[])
+{
+    GLenum osmesa_format = format == format_rgb_osmesa ? OSMESA_RGB : OSMESA_RGBA;
+    size_t nsizes = size_set ? 1 :
+        sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+    size_t ncomp = compression_set ? 1 :
+        sizeof(bench_compressions) / sizeof(bench_compressions[0]);
+    uint64_t *checksums;
+    uint8_t *buffer;
+    OSMesaContext ctx;
+    FILE *json = NULL;
+    uint runs = 0;
+
+    if (!(checksums = (uint64_t*)malloc(count * sizeof(uint64_t)))) {
+        fprintf(stderr, "Alloc checksums failed!\n");
+        return -1;
+    }
+    if (bench_json && !(json = fopen(bench_json, "w"))) {
+        fprintf(stderr, "error: can not open %s\n", bench_json);
+        return -1;
+    }
+    if (json) {
+        fprintf(json, "{\n  \"bench\": [");
+    }
+
+    printf("size      mode   frames frames/s   ratio   render     flip "
+        "compress   base64    write (MB/s) checksum\n");
+    for (size_t i = 0; i < nsizes; i++) {
+        if (!size_set) {
+            width = bench_sizes[i][0];
+            height = bench_sizes[i][1];
+        }
+        if (!(ctx = OSMesaCreateContextExt(osmesa_format, 16, 0, 0, NULL))) {
+            fprintf(stderr, "OSMesaCreateContext failed!\n");
+            return -1;
+        }
+        if (!(buffer = (uint8_t*)malloc(width * height * sizeof(uint))) ||
+            (format == format_rgb &&
+                !(packed = (uint8_t*)malloc(width * height * 3)))) {
+            fprintf(stderr, "Alloc image buffer failed!\n");
+            return -1;
+        }
+        if (!OSMesaMakeCurrent(ctx, buffer, GL_UNSIGNED_BYTE, width, height)) {
+            fprintf(stderr, "OSMesaMakeCurrent failed!\n");
+            return -1;
+        }
+        init();
+        reshape(width, height);
+        for (size_t j = 0; j < ncomp; j++) {
+            if (!compression_set) {
+                compression = bench_compressions[j];
+            }
+            if (bench_run(buffer, checksums) < 0) {
+                return -1;
+            }
+            if (json) {
+                fprintf(json, "%s\n    ", runs ? "," : "");
+                print_bench_run(json, "    ", count, checksums);
+            }
+            runs++;
+        }
+        OSMesaDestroyContext(ctx);
+        free(buffer);
+        free(packed);
+        packed = NULL;
+    }
+
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        if (fclose(json) != 0) {
+            fprintf(stderr, "error: can not write %s\n", bench_json);
+        }
+    }
+    free(checksums);
+    return 0;
+}
+
 /*
  * entry point
  */
 int main(int argc, char **argv)
 {
     parse_options(argc, argv);
+    if (bench) {
+        return kitty_bench(argc, argv) < 0;
+    }
     kitty_gears(argc, argv);
     return 0;
 }
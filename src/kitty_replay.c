@@ -0,0 +1,265 @@
+/*
+ * PLEASE LICENSE 11/2020, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * kitty_replay plays a stream recorded by kitty_gears --record to stdout
+ * or a file, at the recorded frame times or as fast as the output accepts
+ * it. the recording is memory mapped and written straight from the
+ * mapping, so the transport is measured without rendering or encoding.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "kitty_util.h"
+
+static uint help = 0;
+static uint max_speed = 0;
+static uint loops = 1;
+static const char *input_path;
+static const char *output_path;
+
+static size_t acks_received = 0;
+static uint running = 1;
+static uint failed = 0;
+
+static void acknowledge(int iid, const char *status)
+{
+    acks_received++;
+}
+
+static void keystroke(int key)
+{
+    if (key == 'q') running = 0;
+}
+
+/*
+ * help text
+ */
+static void print_help(int argc, char **argv)
+{
+    fprintf(stderr,
+        "Usage: %s [options] <recording>\n"
+        "\n"
+        "Options:\n"
+        "  -o, --output <file>                write to a file instead of stdout\n"
+        "  -m, --max-speed                    ignore the recorded frame times\n"
+        "  -l, --loops <integer>              play the recording N times (default %u)\n"
+        "  -h, --help                         command line help\n",
+        argv[0], loops);
+}
+
+/*
+ * command-line option parsing
+ */
+
+static int check_param(int cond, const char *param)
+{
+    if (cond) {
+        fprintf(stderr, "error: %s requires parameter\n", param);
+    }
+    return (help = cond);
+}
+
+static int match_opt(const char *arg, const char *opt, const char *longopt)
+{
+    return strcmp(arg, opt) == 0 || strcmp(arg, longopt) == 0;
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int i = 1;
+    while (i < argc) {
+        if (match_opt(argv[i], "-o", "--output")) {
+            if (check_param(++i == argc, "--output")) break;
+            output_path = argv[i++];
+        } else if (match_opt(argv[i], "-m", "--max-speed")) {
+            max_speed++;
+            i++;
+        } else if (match_opt(argv[i], "-l", "--loops")) {
+            if (check_param(++i == argc, "--loops")) break;
+            loops = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-h", "--help")) {
+            help++;
+            i++;
+        } else if (argv[i][0] == '-' || input_path) {
+            fprintf(stderr, "error: unknown option: %s\n", argv[i]);
+            help++;
+            break;
+        } else {
+            input_path = argv[i++];
+        }
+    }
+
+    if (!input_path) {
+        help++;
+    }
+    if (help) {
+        print_help(argc, argv);
+        exit(1);
+    }
+}
+
+/*
+ * map a recording and check its header and index are in bounds
+ */
+static const uint8_t* map_recording(const char *path, size_t *len)
+{
+    const kitty_record_header *h;
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "error: can not open %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h)) {
+        fprintf(stderr, "error: %s is not a recording\n", path);
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "error: can not map %s\n", path);
+        return NULL;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    h = (const kitty_record_header*)p;
+    if (memcmp(h->magic, kitty_record_magic, sizeof(h->magic)) != 0 ||
+        h->version != kitty_record_version ||
+        h->index_offset > (uint64_t)st.st_size ||
+        h->frames > (st.st_size - h->index_offset) /
+            sizeof(kitty_record_frame)) {
+        fprintf(stderr, "error: %s is not a recording or is truncated\n",
+            path);
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    *len = st.st_size;
+    return (const uint8_t*)p;
+}
+
+/*
+ * entry point
+ */
+int main(int argc, char **argv)
+{
+    const uint8_t *map;
+    const kitty_record_header *h;
+    const kitty_record_frame *index;
+    kitty_session ks;
+    uint64_t stage_sum[3] = { 0 }, bytes = 0, frames = 0, t0, t1;
+    size_t len;
+    int fd = fileno(stdout), interactive;
+
+    parse_options(argc, argv);
+
+    if (!(map = map_recording(input_path, &len))) {
+        exit(1);
+    }
+    h = (const kitty_record_header*)map;
+    index = (const kitty_record_frame*)(map + h->index_offset);
+    for (uint32_t i = 0; i < h->frames; i++) {
+        if (index[i].offset > h->index_offset ||
+            index[i].len > h->index_offset - index[i].offset) {
+            fprintf(stderr, "error: frame %u is out of bounds\n", i);
+            exit(1);
+        }
+        stage_sum[0] += index[i].render_ns;
+        stage_sum[1] += index[i].encode_ns;
+        stage_sum[2] += index[i].write_ns;
+    }
+
+    if (output_path && (fd = open(output_path,
+            O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "error: can not open %s\n", output_path);
+        exit(1);
+    }
+
+    /* a terminal on stdin answers the images, so keep draining it */
+    if ((interactive = isatty(0))) {
+        kitty_key_callback(keystroke);
+        kitty_ack_callback(acknowledge);
+        kitty_setup_termios();
+    }
+    kitty_session_init(&ks, kitty_compress_none);
+
+    t0 = kitty_clock_ns();
+    for (uint loop = 0; loop < loops && running; loop++) {
+        uint64_t start = kitty_clock_ns();
+        for (uint32_t i = 0; i < h->frames && running; i++) {
+            const kitty_record_frame *f = index + i;
+            if (!max_speed) {
+                uint64_t due = start + f->time_ns, now = kitty_clock_ns();
+                if (due > now) {
+                    struct timespec ts = {
+                        (time_t)((due - now) / 1000000000),
+                        (long)((due - now) % 1000000000)
+                    };
+                    nanosleep(&ts, NULL);
+                }
+            }
+            if (kitty_write_all(&ks, fd, map + f->offset, f->len) < 0) {
+                fprintf(stderr, "error: write failed\n");
+                failed = 1;
+                running = 0;
+                break;
+            }
+            bytes += f->len;
+            frames++;
+            if (interactive) {
+                kitty_poll_events(0);
+            }
+        }
+    }
+    t1 = kitty_clock_ns();
+
+    if (interactive) {
+        kitty_poll_events(100);
+        kitty_restore_termios();
+    }
+    if (output_path) {
+        close(fd);
+    }
+
+    fprintf(stderr, "kitty_replay: %zu frames %zu bytes %.3f sec "
+        "%.2f frames/sec %.2f MB/sec %zu acks\n",
+        (size_t)frames, (size_t)bytes, (t1 - t0) / 1e9,
+        frames * 1e9 / (t1 - t0), bytes * 1e3 / (t1 - t0), acks_received);
+    if (h->frames) {
+        fprintf(stderr, "kitty_replay: recorded %.3f sec %.2f frames/sec "
+            "render %.3f encode %.3f write %.3f (ms/frame)\n",
+            h->duration_ns / 1e9, h->frames * 1e9 / h->duration_ns,
+            stage_sum[0] / 1e6 / h->frames, stage_sum[1] / 1e6 / h->frames,
+            stage_sum[2] / 1e6 / h->frames);
+    }
+
+    kitty_session_destroy(&ks);
+    munmap((void*)map, len);
+
+    return failed;
+}
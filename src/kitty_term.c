@@ -0,0 +1,518 @@
+/*
+ * PLEASE LICENSE 11/2020, Michael Clark <michaeljclark@mac.com>
+ *
+ * All rights to this work are granted for all purposes, with exception of
+ * author's implied right of copyright to defend the free use of this work.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * kitty_term stands in for the terminal on a pty. it runs a command,
+ * answers cursor position and cell size queries and kitty graphics
+ * commands, and checks the images it receives directly, reassembling and
+ * decoding chunked payloads, and through the shared memory and temporary
+ * file mediums. it can type scripted keys into the command, and reports
+ * the frame rate, the bytes received and a checksum of the pixels of every
+ * image so runs can be compared. plain text output from the command is
+ * passed through to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pty.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "kitty_util.h"
+
+static uint help = 0;
+static uint verbose = 0;
+static uint reject_indirect = 0;
+static char **command;
+static uint cell_width = 10, cell_height = 20;
+static const char *keys = "";
+static uint key_delay = 100;
+
+static size_t commands_received = 0;
+static size_t images_verified = 0;
+static size_t images_failed = 0;
+static size_t bytes_received = 0;
+static size_t payload_bytes = 0;
+static size_t pixel_bytes = 0;
+static uint64_t pixel_checksum = 0;
+
+/* reassembled direct payload and the decoded and inflated pixels */
+static kitty_buf chunks;
+static kitty_buf decoded;
+static kitty_buf inflated;
+
+/*
+ * base64 decoding
+ */
+
+static uint8_t* _get_base64dec_tab()
+{
+    static uint8_t tab[256];
+    static int init;
+
+    if (!init) {
+        memset(tab, 0xff, sizeof(tab));
+        for (uint i = 0; i < 64; i++) tab[base64enc_tab[i]] = (uint8_t)i;
+        init = 1;
+    }
+    return tab;
+}
+
+static ssize_t base64_decode
+    (size_t in_len, const char *in, size_t out_len, uint8_t *out)
+{
+    const uint8_t *tab = _get_base64dec_tab();
+    uint_least32_t v = 0;
+    size_t ii = 0, io = 0;
+    uint rem = 0;
+
+    /* whole quads first, then the padded tail */
+    while (ii + 4 <= in_len && io + 3 <= out_len) {
+        uint a = tab[(uint8_t)in[ii]], b = tab[(uint8_t)in[ii+1]];
+        uint c = tab[(uint8_t)in[ii+2]], d = tab[(uint8_t)in[ii+3]];
+        if ((a | b | c | d) & 0x80) break;
+        v = a << 18 | b << 12 | c << 6 | d;
+        out[io++] = (uint8_t)(v >> 16);
+        out[io++] = (uint8_t)(v >> 8);
+        out[io++] = (uint8_t)v;
+        ii += 4;
+    }
+    for (v = 0; ii < in_len && in[ii] != '='; ii++) {
+        uint c = tab[(uint8_t)in[ii]];
+        if (c & 0x80) return -1;
+        v = (v << 6) | c;
+        rem += 6;
+        if (rem >= 8) {
+            rem -= 8;
+            if (io >= out_len) return -1;
+            out[io++] = (uint8_t)(v >> rem);
+        }
+    }
+    return (ssize_t)io;
+}
+
+/*
+ * graphics command keys
+ */
+
+typedef struct gfx_cmd {
+    char a, t, o;
+    uint32_t i, f, s, v, q, m;
+    size_t S, O;
+} gfx_cmd;
+
+static gfx_cmd parse_keys(const char *keys, size_t len)
+{
+    gfx_cmd c = { 't', 'd', 0, 0, 32, 0, 0, 0, 0, 0, 0 };
+    size_t p = 0;
+
+    while (p + 2 <= len && keys[p+1] == '=') {
+        char k = keys[p];
+        const char *val = keys + p + 2;
+        unsigned long long n = strtoull(val, NULL, 10);
+        switch (k) {
+        case 'a': c.a = *val; break;
+        case 't': c.t = *val; break;
+        case 'o': c.o = *val; break;
+        case 'i': c.i = (uint32_t)n; break;
+        case 'f': c.f = (uint32_t)n; break;
+        case 's': c.s = (uint32_t)n; break;
+        case 'v': c.v = (uint32_t)n; break;
+        case 'q': c.q = (uint32_t)n; break;
+        case 'm': c.m = (uint32_t)n; break;
+        case 'S': c.S = (size_t)n; break;
+        case 'O': c.O = (size_t)n; break;
+        }
+        while (p < len && keys[p] != ',') p++;
+        p++;
+    }
+    return c;
+}
+
+static void reply(int fd, gfx_cmd *c, const char *status)
+{
+    char buf[256];
+    int len;
+
+    if (!c->i) return;
+    if (c->q >= 2 || (c->q == 1 && strcmp(status, "OK") == 0)) return;
+    len = snprintf(buf, sizeof(buf), "\x1B_Gi=%u;%s\x1B\\", c->i, status);
+    if (write(fd, buf, len) != len) {
+        perror("write");
+    }
+}
+
+/*
+ * check the pixel data of an image matches its dimensions, inflating
+ * it first if it is compressed, and add it to the pixel checksum.
+ */
+static const char* check_pixels(gfx_cmd *c, const uint8_t *data, size_t len)
+{
+    size_t expected = (size_t)c->s * c->v * (c->f / 8);
+    uint64_t hash;
+
+    if (c->o == 'z') {
+#ifdef HAVE_ZLIB
+        uLongf pixels_len = expected + 1;
+        if (kitty_buf_reserve(&inflated, expected + 1) < 0) {
+            return "ENOMEM:out of memory";
+        }
+        int ret = uncompress(inflated.data, &pixels_len, data, len);
+        if (ret != Z_OK) return "EINVAL:inflate failed";
+        data = inflated.data;
+        len = pixels_len;
+#else
+        return "ENOTSUP:compression unsupported";
+#endif
+    }
+    if (len != expected) return "EINVAL:size mismatch";
+
+    hash = kitty_hash64(data, len);
+    pixel_checksum = kitty_hash_mix(pixel_checksum, hash);
+    pixel_bytes += len;
+    if (verbose > 1) {
+        fprintf(stderr, "kitty_term: i=%u a=%c %ux%u hash=%016llx\n",
+            c->i, c->a, c->s, c->v, (unsigned long long)hash);
+    }
+    return "OK";
+}
+
+/* placements, deletions and queries carry no pixels to check */
+static int has_pixels(gfx_cmd *c)
+{
+    return c->a == 't' || c->a == 'T' || c->a == 'f';
+}
+
+static void count_image(gfx_cmd *c, const char *status)
+{
+    if (!has_pixels(c)) return;
+    if (strcmp(status, "OK") == 0) images_verified++;
+    else images_failed++;
+}
+
+/*
+ * read and check an image from a shared memory object or temporary file,
+ * then unlink it as the terminal would.
+ */
+static const char* check_object(gfx_cmd *c, const char *name)
+{
+    const char *status = "OK";
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (reject_indirect) {
+        status = "ENOTSUP:indirect transmission rejected";
+    } else if ((fd = c->t == 's' ? shm_open(name, O_RDONLY, 0)
+                                 : open(name, O_RDONLY)) < 0) {
+        return c->t == 's' ? "EBADF:shm_open failed" : "EBADF:open failed";
+    } else {
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < c->O + c->S) {
+            status = "EINVAL:object too small";
+        } else {
+            size_t len = c->S ? c->S : (size_t)st.st_size - c->O;
+            p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                status = "EBADF:mmap failed";
+            } else {
+                /* queries only test that the medium works */
+                if (c->a != 'q') {
+                    status = check_pixels(c, (const uint8_t*)p + c->O, len);
+                }
+                munmap(p, st.st_size);
+            }
+        }
+        close(fd);
+    }
+    if (c->t == 's') {
+        shm_unlink(name);
+    } else if (strstr(name, "tty-graphics-protocol")) {
+        unlink(name);
+    }
+    return status;
+}
+
+/*
+ * handle one graphics command, <keys>;<payload>
+ */
+static void handle_gfx(int fd, const char *body, size_t len)
+{
+    static gfx_cmd first;
+    static uint32_t chunked;
+    ssize_t ret;
+    const char *semi = (const char*)memchr(body, ';', len);
+    size_t keys_len = semi ? (size_t)(semi - body) : len;
+    const char *payload = semi ? semi + 1 : body + len;
+    size_t payload_len = len - keys_len - (semi ? 1 : 0);
+    gfx_cmd c = parse_keys(body, keys_len);
+    const char *status = "OK";
+    char name[256];
+
+    commands_received++;
+
+    if (c.t == 's' || c.t == 't') {
+        ret = base64_decode(payload_len, payload, sizeof(name) - 1,
+            (uint8_t*)name);
+        if (ret < 0) {
+            status = "EINVAL:bad object name";
+        } else {
+            name[ret] = '\0';
+            status = check_object(&c, name);
+        }
+        count_image(&c, status);
+        if (verbose) {
+            fprintf(stderr, "kitty_term: i=%u t=%c %ux%u %s\n",
+                c.i, c.t, c.s, c.v, status);
+        }
+        reply(fd, &c, status);
+    } else {
+        /* only the first chunk has the keys, the rest only have m= */
+        if (!chunked) {
+            first = c;
+            chunks.len = 0;
+        }
+        chunked = c.m;
+        kitty_buf_append(&chunks, payload, payload_len);
+        if (chunked) return;
+
+        payload_bytes += chunks.len;
+        if (has_pixels(&first)) {
+            if (kitty_buf_reserve(&decoded, chunks.len / 4 * 3 + 3) < 0) {
+                status = "ENOMEM:out of memory";
+            } else if ((ret = base64_decode(chunks.len,
+                    (const char*)chunks.data, decoded.cap,
+                    decoded.data)) < 0) {
+                status = "EINVAL:bad base64";
+            } else {
+                status = check_pixels(&first, decoded.data, (size_t)ret);
+            }
+            count_image(&first, status);
+            if (verbose) {
+                fprintf(stderr, "kitty_term: i=%u t=%c %ux%u %s\n",
+                    first.i, first.t, first.s, first.v, status);
+            }
+        }
+        /* direct transmission is acknowledged on its last chunk */
+        reply(fd, &first, status);
+    }
+}
+
+/*
+ * scan terminal output for escape sequences we need to answer. returns
+ * the number of bytes consumed, leaving incomplete sequences in place.
+ */
+static size_t scan(int fd, const char *buf, size_t len)
+{
+    size_t p = 0;
+
+    while (p < len) {
+        const char *esc = (const char*)memchr(buf + p, '\x1B', len - p);
+        /* pass plain text through, such as the command's statistics */
+        fwrite(buf + p, (esc ? (size_t)(esc - buf) : len) - p, 1, stdout);
+        if (!esc) return len;
+        p = esc - buf;
+        if (p + 1 >= len) return p;
+        if (buf[p+1] == '[') {
+            size_t e = p + 2;
+            while (e < len && !(buf[e] >= 0x40 && buf[e] <= 0x7e)) e++;
+            if (e >= len) return p;
+            if (buf[e] == 'n' && e == p + 3 && buf[p+2] == '6') {
+                const char *cpr = "\x1B[1;1R";
+                if (write(fd, cpr, strlen(cpr)) < 0) perror("write");
+            } else if (buf[e] == 't' && e == p + 4 &&
+                    buf[p+2] == '1' && buf[p+3] == '6') {
+                char csz[32];
+                int n = snprintf(csz, sizeof(csz), "\x1B[6;%u;%ut",
+                    cell_height, cell_width);
+                if (write(fd, csz, n) < 0) perror("write");
+            }
+            p = e + 1;
+        } else if (buf[p+1] == '_') {
+            const char *st = NULL;
+            for (size_t e = p + 2; e + 1 < len; e++) {
+                if (buf[e] == '\x1B' && buf[e+1] == '\\') {
+                    st = buf + e;
+                    break;
+                }
+            }
+            if (!st) return p;
+            if (buf[p+2] == 'G') {
+                handle_gfx(fd, buf + p + 3, st - (buf + p + 3));
+            }
+            p = (st - buf) + 2;
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+/*
+ * help text
+ */
+static void print_help(int argc, char **argv)
+{
+    fprintf(stderr,
+        "Usage: %s [options] -- <command> [args...]\n"
+        "\n"
+        "Options:\n"
+        "  -r, --reject-indirect              fail shared memory and file transmissions\n"
+        "  -k, --keys <string>                type keys into the command one at a time\n"
+        "  -d, --key-delay <integer>          delay ms before each key (default %u)\n"
+        "  -v, --verbose                      log each graphics command, twice for hashes\n"
+        "  -h, --help                         command line help\n",
+        argv[0], key_delay);
+}
+
+/*
+ * command-line option parsing
+ */
+
+static int check_param(int cond, const char *param)
+{
+    if (cond) {
+        fprintf(stderr, "error: %s requires parameter\n", param);
+    }
+    return (help = cond);
+}
+
+static int match_opt(const char *arg, const char *opt, const char *longopt)
+{
+    return strcmp(arg, opt) == 0 || strcmp(arg, longopt) == 0;
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "--") == 0) {
+            command = argv + i + 1;
+            break;
+        } else if (match_opt(argv[i], "-r", "--reject-indirect")) {
+            reject_indirect++;
+            i++;
+        } else if (match_opt(argv[i], "-k", "--keys")) {
+            if (check_param(++i == argc, "--keys")) break;
+            keys = argv[i++];
+        } else if (match_opt(argv[i], "-d", "--key-delay")) {
+            if (check_param(++i == argc, "--key-delay")) break;
+            key_delay = atoi(argv[i++]);
+        } else if (match_opt(argv[i], "-v", "--verbose")) {
+            verbose++;
+            i++;
+        } else if (match_opt(argv[i], "-h", "--help")) {
+            help++;
+            i++;
+        } else {
+            fprintf(stderr, "error: unknown option: %s\n", argv[i]);
+            help++;
+            break;
+        }
+    }
+
+    if (!command || !command[0]) {
+        help++;
+    }
+    if (help) {
+        print_help(argc, argv);
+        exit(1);
+    }
+}
+
+/*
+ * entry point
+ */
+int main(int argc, char **argv)
+{
+    kitty_buf in = { 0 };
+    char buf[65536];
+    int fd, status;
+    pid_t pid;
+    ssize_t r;
+    uint64_t start_ns, next_key_ns, now, elapsed_ns;
+    size_t keys_sent = 0, keys_len;
+
+    parse_options(argc, argv);
+    keys_len = strlen(keys);
+
+    /* an 80x24 window of 10x20 pixel cells */
+    struct winsize ws = { 24, 80, 80 * cell_width, 24 * cell_height };
+
+    if ((pid = forkpty(&fd, NULL, NULL, &ws)) < 0) {
+        perror("forkpty");
+        exit(1);
+    }
+    if (pid == 0) {
+        execvp(command[0], command);
+        perror("execvp");
+        _exit(127);
+    }
+
+    start_ns = next_key_ns = kitty_clock_ns();
+    next_key_ns += (uint64_t)key_delay * 1000000;
+
+    /* the pty master reports EIO once the command has exited */
+    for (;;) {
+        int timeout = -1;
+        if (keys_sent < keys_len) {
+            now = kitty_clock_ns();
+            if (now >= next_key_ns) {
+                if (write(fd, keys + keys_sent, 1) < 0) perror("write");
+                keys_sent++;
+                next_key_ns = now + (uint64_t)key_delay * 1000000;
+                continue;
+            }
+            timeout = (int)((next_key_ns - now + 999999) / 1000000);
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (!pfd.revents) continue;
+        if ((r = read(fd, buf, sizeof(buf))) < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        bytes_received += r;
+        kitty_buf_append(&in, buf, r);
+        size_t n = scan(fd, (const char*)in.data, in.len);
+        memmove(in.data, in.data + n, in.len - n);
+        in.len -= n;
+    }
+    elapsed_ns = kitty_clock_ns() - start_ns;
+    waitpid(pid, &status, 0);
+    kitty_buf_destroy(&in);
+    kitty_buf_destroy(&chunks);
+    kitty_buf_destroy(&decoded);
+    kitty_buf_destroy(&inflated);
+
+    fprintf(stderr, "kitty_term: commands=%zu verified=%zu failed=%zu\n",
+        commands_received, images_verified, images_failed);
+    fprintf(stderr, "kitty_term: %.3f sec %.2f images/sec %.2f MB/sec "
+        "bytes=%zu payload=%zu pixels=%zu checksum=%016llx\n",
+        elapsed_ns / 1e9, images_verified / (elapsed_ns / 1e9),
+        bytes_received / (elapsed_ns / 1e3), bytes_received, payload_bytes,
+        pixel_bytes, (unsigned long long)pixel_checksum);
+
+    return images_failed || !WIFEXITED(status) || WEXITSTATUS(status);
+}
@@ -19,11 +19,29 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
 
 #include <alloca.h>
 #include <unistd.h>
 #include <termios.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /*
  * base64.c : base-64 / MIME encode/decode
@@ -34,7 +52,7 @@
 static const uint8_t base64enc_tab[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static int base64_encode
+static int base64_encode_scalar
     (size_t in_len, const uint8_t *in, size_t out_len, char *out)
 {
     uint ii, io;
@@ -67,291 +85,3572 @@ static int base64_encode
 }
 
 /*
- * zlib compression
+ * SIMD base64 encoders
+ *
+ * the vector encoders translate 12 (SSE4.1), 24 (AVX2) or 48 (NEON) input
+ * bytes per step using the shuffle and multiply bit unpacking technique
+ * described by Wojciech Muła, then hand the remainder to the scalar
+ * encoder, which keeps the output byte identical including the padding.
  */
-#ifdef HAVE_ZLIB
 
-typedef struct zlib_span { const uint8_t *data; size_t len; } zlib_span;
+typedef int (*base64_encode_fn)
+    (size_t in_len, const uint8_t *in, size_t out_len, char *out);
 
-static zlib_span kitty_zlib_compress
-    (const uint8_t *data, size_t len, uint32_t compression)
+static int base64_encode_tail
+    (size_t ii, size_t io, size_t in_len, const uint8_t *in,
+    size_t out_len, char *out)
 {
-    zlib_span result = { NULL, 0 };
-    z_stream s = { 0 };
-    uint8_t *xdata;
-    size_t xlen;
-    int ret;
+    int ret = base64_encode_scalar(in_len - ii, in + ii,
+        out_len - io, out + io);
+    return ret < 0 ? ret : (int)(ret + io);
+}
 
-    deflateInit(&s, compression > 1 ? Z_BEST_COMPRESSION : Z_BEST_SPEED);
-    xlen = deflateBound(&s, len);
-    if (!(xdata = malloc(xlen))) {
-        return result;
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i base64_unpack_sse41(__m128i in)
+{
+    /* gather 3 byte groups into 4 byte lanes: [b1 b0 b2 b1] */
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    /* shift 6-bit fields into the low bits of each output byte */
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i idx = _mm_or_si128(t1, t3);
+    /* map 6-bit indices to ascii using a 16 entry offset table */
+    __m128i red = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i lt26 = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    red = _mm_or_si128(red, _mm_and_si128(lt26, _mm_set1_epi8(13)));
+    __m128i lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(lut, red), idx);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static int base64_encode_sse41
+    (size_t in_len, const uint8_t *in, size_t out_len, char *out)
+{
+    size_t ii = 0, io = 0;
+
+    /* 16 byte loads consume 12 bytes, so stop 4 bytes short of the end */
+    while (ii + 16 <= in_len && io + 16 < out_len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + ii));
+        _mm_storeu_si128((__m128i*)(out + io), base64_unpack_sse41(v));
+        ii += 12;
+        io += 16;
     }
-    s.avail_in = len;
-    s.next_in = (uint8_t*)data;
-    s.avail_out = xlen;
-    s.next_out = xdata;
-    do {
-        if (Z_STREAM_ERROR == (ret = deflate(&s, Z_FINISH))) {
-            free(xdata);
-            return result;
-        }
-    } while (s.avail_out == 0);
-    assert(s.avail_in == 0);
-    result.data = xdata;
-    result.len = s.total_out;
-    deflateEnd(&s);
+    return base64_encode_tail(ii, io, in_len, in, out_len, out);
+}
 
-    return result;
+__attribute__((target("avx2")))
+static inline __m256i base64_unpack_avx2(__m256i in)
+{
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i red = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i lt26 = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    red = _mm256_or_si256(red, _mm256_and_si256(lt26, _mm256_set1_epi8(13)));
+    __m256i lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lut, red), idx);
 }
 
-#endif
+__attribute__((target("avx2")))
+static int base64_encode_avx2
+    (size_t in_len, const uint8_t *in, size_t out_len, char *out)
+{
+    size_t ii = 0, io = 0;
 
-/*
- * kitty image protocol
- *
- * outputs base64 encoding of image data
- */
+    /* each 128-bit lane takes 12 bytes, the high lane loads at +12 */
+    while (ii + 28 <= in_len && io + 32 < out_len) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(in + ii));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(in + ii + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i*)(out + io), base64_unpack_avx2(v));
+        ii += 24;
+        io += 32;
+    }
+    return base64_encode_tail(ii, io, in_len, in, out_len, out);
+}
 
-static size_t kitty_send_rgba
-    (char cmd, uint32_t id, uint32_t compression,
-    const uint8_t *color_pixels, uint32_t width, uint32_t height)
+static int base64_has_sse41()
 {
-    const size_t chunk_limit = 4096;
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+}
 
-    size_t pixel_count = width * height;
-    size_t total_size = pixel_count << 2;
-    const uint8_t *encode_data;
-    size_t encode_size;
-    zlib_span z;
+static int base64_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
 
-#ifdef HAVE_ZLIB
-#define COMPRESSION_STRING (compression ? ",o=z" : "")
-#else
-#define COMPRESSION_STRING ""
 #endif
 
-#ifdef HAVE_ZLIB
-    /*
-     * if compression is enabled, compress data before base64 encoding.
-     */
-    if (compression) {
-        z = kitty_zlib_compress(color_pixels, total_size, compression);
-        if (!z.data) return 0;
-        encode_data = z.data;
-        encode_size = z.len;
-    } else {
-        encode_data = color_pixels;
-        encode_size = total_size;
+#if defined(__aarch64__)
+
+static int base64_encode_neon
+    (size_t in_len, const uint8_t *in, size_t out_len, char *out)
+{
+    size_t ii = 0, io = 0;
+    const uint8x16x4_t lut = vld1q_u8_x4(base64enc_tab);
+    const uint8x16_t m6 = vdupq_n_u8(0x3f);
+
+    /* de-interleaving loads split 48 bytes into the three byte columns */
+    while (ii + 48 <= in_len && io + 64 < out_len) {
+        uint8x16x3_t v = vld3q_u8(in + ii);
+        uint8x16x4_t r;
+        r.val[0] = vshrq_n_u8(v.val[0], 2);
+        r.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[1], 4),
+            vshlq_n_u8(v.val[0], 4)), m6);
+        r.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[2], 6),
+            vshlq_n_u8(v.val[1], 2)), m6);
+        r.val[3] = vandq_u8(v.val[2], m6);
+        r.val[0] = vqtbl4q_u8(lut, r.val[0]);
+        r.val[1] = vqtbl4q_u8(lut, r.val[1]);
+        r.val[2] = vqtbl4q_u8(lut, r.val[2]);
+        r.val[3] = vqtbl4q_u8(lut, r.val[3]);
+        vst4q_u8((uint8_t*)out + io, r);
+        ii += 48;
+        io += 64;
     }
-#else
-    encode_data = color_pixels;
-    encode_size = total_size;
+    return base64_encode_tail(ii, io, in_len, in, out_len, out);
+}
+
+static int base64_has_neon() { return 1; }
+
 #endif
 
-    size_t base64_size = ((encode_size + 2) / 3) * 4;
-    uint8_t *base64_pixels = (uint8_t*)alloca(base64_size+1);
+static int base64_has_scalar() { return 1; }
 
-    /* base64 encode the data */
-    int ret = base64_encode(encode_size, encode_data, base64_size+1,
-        (char*)base64_pixels);
-    if (ret < 0) {
-        fprintf(stderr, "error: base64_encode failed: ret=%d\n", ret);
-        exit(1);
+/*
+ * base64 encoder table, in order of preference from worst to best.
+ */
+
+typedef struct base64_impl {
+    const char *name;
+    int (*supported)();
+    base64_encode_fn encode;
+} base64_impl;
+
+static const base64_impl base64_impls[] = {
+    { "scalar", base64_has_scalar, base64_encode_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse4.1", base64_has_sse41,  base64_encode_sse41 },
+    { "avx2",   base64_has_avx2,   base64_encode_avx2 },
+#endif
+#if defined(__aarch64__)
+    { "neon",   base64_has_neon,   base64_encode_neon },
+#endif
+};
+
+static const size_t base64_impl_count =
+    sizeof(base64_impls) / sizeof(base64_impls[0]);
+
+static const base64_impl* base64_select()
+{
+    static const base64_impl *impl;
+    if (!impl) {
+        for (size_t i = 0; i < base64_impl_count; i++) {
+            if (base64_impls[i].supported()) impl = &base64_impls[i];
+        }
     }
+    return impl;
+}
 
-    /*
-     * write kitty protocol RGBA image in chunks no greater than 4096 bytes
-     *
-     * <ESC>_Gf=32,s=<w>,v=<h>,m=1;<encoded pixel data first chunk><ESC>\
-     * <ESC>_Gm=1;<encoded pixel data second chunk><ESC>\
-     * <ESC>_Gm=0;<encoded pixel data last chunk><ESC>\
-     */
+static int base64_encode
+    (size_t in_len, const uint8_t *in, size_t out_len, char *out)
+{
+    return base64_select()->encode(in_len, in, out_len, out);
+}
 
-    size_t sent_bytes = 0;
-    while (sent_bytes < base64_size) {
-        size_t chunk_size = base64_size - sent_bytes < chunk_limit
-            ? base64_size - sent_bytes : chunk_limit;
-        int cont = !!(sent_bytes + chunk_size < base64_size);
-        if (sent_bytes == 0) {
-            fprintf(stdout,"\x1B_Gf=32,a=%c,i=%u,s=%d,v=%d,m=%d%s;",
-                cmd, id, width, height, cont, COMPRESSION_STRING);
-        } else {
-            fprintf(stdout,"\x1B_Gm=%d;", cont);
+/*
+ * monotonic clock
+ */
+
+static uint64_t kitty_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * growable byte buffer
+ *
+ * used for output arenas that are reused across frames and only grow.
+ */
+
+typedef struct kitty_buf { uint8_t *data; size_t len; size_t cap; } kitty_buf;
+
+static int kitty_buf_reserve(kitty_buf *b, size_t cap)
+{
+    if (b->cap < cap) {
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) {
+            return -1;
         }
-        fwrite(base64_pixels + sent_bytes, chunk_size, 1, stdout);
-        fprintf(stdout, "\x1B\\");
-        sent_bytes += chunk_size;
+        b->data = data;
+        b->cap = cap;
     }
-    fflush(stdout);
+    return 0;
+}
 
-#ifdef HAVE_ZLIB
-    /* 
-     * carefully only free encoded data if compression is enabled, because
-     * if compression is not enabled, encoded_data is stack from alloca.
-     */
-    if (compression) {
-        free((void*)encode_data);
+/* grow geometrically so there is space for len more bytes */
+static int kitty_buf_grow(kitty_buf *b, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap <<= 1;
+        if (kitty_buf_reserve(b, cap) < 0) {
+            return -1;
+        }
     }
-#endif
-    return encode_size;
+    return 0;
+}
+
+static int kitty_buf_append(kitty_buf *b, const void *data, size_t len)
+{
+    if (kitty_buf_grow(b, len) < 0) {
+        return -1;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void kitty_buf_destroy(kitty_buf *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(kitty_buf));
 }
 
 /*
- * kitty terminal helpers
+ * pixel rows
+ *
+ * describes pixel data as rows of row_size bytes that are stride bytes
+ * apart, so rectangles can be sent straight from a frame buffer. a
+ * negative stride walks the frame from the bottom up.
  */
 
-struct line { size_t r; char buf[256]; };
-struct kdata { int iid; size_t offset; struct line data; };
-struct pos  { int x, y; };
-
-typedef struct line line;
-typedef struct kdata kdata;
-typedef struct pos pos;
+typedef struct kitty_rows {
+    const uint8_t *data;
+    size_t row_size;
+    ptrdiff_t stride;
+    uint32_t rows;
+} kitty_rows;
 
-static line kitty_recv_term(int timeout)
+static kitty_rows kitty_rows_span(const uint8_t *data, size_t len)
 {
-    line l = { 0, { 0 }};
-    int r;
-    struct pollfd fds[1];
+    return (kitty_rows) { data, len, (ptrdiff_t)len, 1 };
+}
 
-    memset(fds, 0, sizeof(fds));
-    fds[0].fd = fileno(stdin);
-    fds[0].events = POLLIN;
+static int kitty_rows_contiguous(kitty_rows src)
+{
+    return src.rows <= 1 || src.stride == (ptrdiff_t)src.row_size;
+}
 
-    if ((r = poll(fds, 1, timeout)) < 0) {
-        return l;
+static int kitty_rows_gather(kitty_buf *b, kitty_rows src)
+{
+    if (kitty_buf_reserve(b, src.row_size * src.rows) < 0) {
+        return -1;
     }
-    if ((fds[0].revents & POLLIN) == 0) {
-        return l;
+    for (uint32_t y = 0; y < src.rows; y++) {
+        memcpy(b->data + y * src.row_size, src.data + y * src.stride,
+            src.row_size);
     }
+    b->len = src.row_size * src.rows;
+    return 0;
+}
+
+/*
+ * bounded blocking queue
+ *
+ * fixed capacity ring of pointers used to hand frames between threads.
+ */
 
-    l.r = read(0, l.buf, sizeof(l.buf)-1);
-    if (l.r > 0) {
-        l.buf[l.r] = '\0';
+typedef struct kitty_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    size_t cap;
+    size_t head;
+    size_t count;
+} kitty_queue;
+
+static int kitty_queue_init(kitty_queue *q, size_t cap)
+{
+    memset(q, 0, sizeof(kitty_queue));
+    if (!(q->items = (void**)calloc(cap, sizeof(void*)))) {
+        return -1;
     }
+    q->cap = cap;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
 
-    return l;
+static void kitty_queue_destroy(kitty_queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    memset(q, 0, sizeof(kitty_queue));
 }
 
-static line kitty_send_term(const char* s)
+static void kitty_queue_push(kitty_queue *q, void *item)
 {
-    fputs(s, stdout);
-    fflush(stdout);
-    return kitty_recv_term(-1);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count++) % q->cap] = item;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
 }
 
-static void kitty_set_position(int x, int y)
+static void* kitty_queue_pop(kitty_queue *q)
 {
-    printf("\x1B[%d;%dH", y, x);
-    fflush(stdout);
+    void *item;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    item = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
 }
 
-static pos kitty_get_position()
+/*
+ * compression modes
+ *
+ * compression counts up from none, with one for the fastest level and two
+ * or more for the best. rle uses the fastest level with the run length
+ * strategy, which only finds repeats of the previous byte and suits
+ * frames that are mostly background. rgba uses the built in pixel
+ * encoder below. auto picks a mode for each frame.
+ */
+
+enum kitty_compress {
+    kitty_compress_none = 0,
+    kitty_compress_speed = 1,
+    kitty_compress_best = 2,
+    kitty_compress_rle = 16,
+    kitty_compress_auto = 17,
+    kitty_compress_rgba = 18
+};
+
+/*
+ * zlib compression
+ *
+ * the deflate stream and output arena live for the whole session. the
+ * stream is reset between frames and the arena only grows, so after the
+ * first frame compression performs no allocations.
+ */
+
+typedef struct zlib_span { const uint8_t *data; size_t len; } zlib_span;
+
+#ifdef HAVE_ZLIB
+
+typedef struct kitty_zlib {
+    z_stream s;
+    int level;
+    int wbits;
+    int strategy;
+    kitty_buf out;
+} kitty_zlib;
+
+static void kitty_zlib_init(kitty_zlib *kz)
 {
-    pos p;
-    line l = kitty_send_term("\x1B[6n");
-    int r = sscanf(l.buf+1, "[%d;%dR", &p.y, &p.x);
-    return p;
+    memset(kz, 0, sizeof(kitty_zlib));
+    kz->level = -2;
 }
 
-static void kitty_hide_cursor()
+static void kitty_zlib_destroy(kitty_zlib *kz)
 {
-    puts("\x1B[?25l");
+    if (kz->level != -2) {
+        deflateEnd(&kz->s);
+    }
+    kitty_buf_destroy(&kz->out);
+    kitty_zlib_init(kz);
 }
 
-static void kitty_show_cursor()
+static int kitty_zlib_level(uint32_t compression)
 {
-    puts("\x1B[?25h");
+    return compression == kitty_compress_rle ? Z_BEST_SPEED :
+        compression > 1 ? Z_BEST_COMPRESSION : Z_BEST_SPEED;
 }
 
-static kdata kitty_parse_response(line l)
+static int kitty_zlib_strategy(uint32_t compression)
 {
-    /*
-     * parse kitty response of the form: "\x1B_Gi=<image_id>;OK\x1B\\"
-     *
-     * NOTE: a keypress can be present before or after the data
-     */
-    if (l.r < 1) {
-        return (kdata) { -1, 0, l };
+    return compression == kitty_compress_rle ? Z_RLE : Z_DEFAULT_STRATEGY;
+}
+
+static int kitty_zlib_reset
+    (kitty_zlib *kz, int level, int wbits, int strategy)
+{
+    if (kz->level == level && kz->wbits == wbits &&
+            kz->strategy == strategy) {
+        return deflateReset(&kz->s);
+    }
+    if (kz->level != -2) {
+        deflateEnd(&kz->s);
+    }
+    memset(&kz->s, 0, sizeof(kz->s));
+    kz->level = -2;
+    if (deflateInit2(&kz->s, level, Z_DEFLATED, wbits, 8,
+            strategy) != Z_OK) {
+        return Z_STREAM_ERROR;
     }
-    char *esc = strchr(l.buf, '\x1B');
-    if (!esc) {
-        return (kdata) { -1, 0, l };
+    kz->level = level;
+    kz->wbits = wbits;
+    kz->strategy = strategy;
+    return Z_OK;
+}
+
+static zlib_span kitty_zlib_compress
+    (kitty_zlib *kz, const uint8_t *data, size_t len, uint32_t compression)
+{
+    zlib_span result = { NULL, 0 };
+    int ret;
+
+    if (kitty_zlib_reset(kz, kitty_zlib_level(compression), MAX_WBITS,
+            kitty_zlib_strategy(compression))) {
+        return result;
     }
-    ptrdiff_t offset = (esc - l.buf) + 1;
-    int iid = 0;
-    int r = sscanf(l.buf+offset, "_Gi=%d;OK", &iid);
-    if (r != 1) {
-        return (kdata) { -1, 0, l };
+    if (kitty_buf_reserve(&kz->out, deflateBound(&kz->s, len)) < 0) {
+        return result;
+    }
+    kz->s.avail_in = len;
+    kz->s.next_in = (uint8_t*)data;
+    kz->s.avail_out = kz->out.cap;
+    kz->s.next_out = kz->out.data;
+    /* output space is at least deflateBound so one call must finish */
+    if ((ret = deflate(&kz->s, Z_FINISH)) != Z_STREAM_END) {
+        return result;
     }
-    return (kdata) { iid, offset, l };
+    assert(kz->s.avail_in == 0);
+    result.data = kz->out.data;
+    result.len = kz->out.len = kz->s.total_out;
+
+    return result;
 }
 
 /*
- * flip image buffer y-axis
+ * compress rows that are not contiguous as one stream, feeding deflate a
+ * row at a time so the rows are not gathered first.
  */
-static void kitty_flip_buffer_y
-    (uint32_t* buffer, uint32_t width, uint32_t height)
+static zlib_span kitty_zlib_compress_rows
+    (kitty_zlib *kz, kitty_rows src, uint32_t compression)
 {
-    /* Iterate only half the buffer to get a full flip */
-    size_t rows = height >> 1;
-    size_t line_size = width * sizeof(uint32_t);
-    uint32_t* scan_line = (uint32_t*)alloca(line_size);
+    zlib_span result = { NULL, 0 };
 
-    for (uint32_t rowIndex = 0; rowIndex < rows; rowIndex++)
-    {
-        size_t l1 = rowIndex * width;
-        size_t l2 = (height - rowIndex - 1) * width;
-        memcpy(scan_line, buffer + l1, line_size);
-        memcpy(buffer + l1, buffer + l2, line_size);
-        memcpy(buffer + l2, scan_line, line_size);
+    if (kitty_zlib_reset(kz, kitty_zlib_level(compression), MAX_WBITS,
+            kitty_zlib_strategy(compression))) {
+        return result;
+    }
+    if (kitty_buf_reserve(&kz->out,
+            deflateBound(&kz->s, src.row_size * src.rows)) < 0) {
+        return result;
+    }
+    kz->s.avail_out = kz->out.cap;
+    kz->s.next_out = kz->out.data;
+    for (uint32_t y = 0; y < src.rows; y++) {
+        kz->s.avail_in = src.row_size;
+        kz->s.next_in = (uint8_t*)src.data + y * src.stride;
+        if (deflate(&kz->s, Z_NO_FLUSH) != Z_OK) {
+            return result;
+        }
+        assert(kz->s.avail_in == 0);
+    }
+    if (deflate(&kz->s, Z_FINISH) != Z_STREAM_END) {
+        return result;
     }
+    result.data = kz->out.data;
+    result.len = kz->out.len = kz->s.total_out;
+
+    return result;
 }
 
-typedef void (*key_cb)(int k);
+/*
+ * parallel zlib compression
+ *
+ * splits the frame into row bands, compresses each band as raw deflate on
+ * its own thread ending with a full flush so the bands are byte aligned
+ * and independent, then stitches the bands between a zlib header and the
+ * adler32 of the whole frame combined from the per-band checksums. the
+ * result is a single standard zlib stream. bands of rows that are not
+ * contiguous are fed to deflate a row at a time.
+ */
 
-static key_cb* _get_key_callback()
+typedef struct kitty_zlib_band {
+    kitty_zlib z;
+    kitty_rows src;
+    int level;
+    int strategy;
+    int last;
+    int ok;
+    uLong adler;
+} kitty_zlib_band;
+
+typedef struct kitty_zlib_mt {
+    uint32_t nbands;
+    kitty_zlib_band **bands;
+    pthread_t *threads;
+    kitty_buf out;
+} kitty_zlib_mt;
+
+static void kitty_zlib_mt_init(kitty_zlib_mt *mt)
 {
-    static key_cb cb;
-    return &cb;
+    memset(mt, 0, sizeof(kitty_zlib_mt));
 }
 
-static void kitty_key_callback(key_cb cb)
+static void kitty_zlib_mt_destroy(kitty_zlib_mt *mt)
 {
-    *_get_key_callback() = cb;
+    for (uint32_t i = 0; i < mt->nbands; i++) {
+        kitty_zlib_destroy(&mt->bands[i]->z);
+        free(mt->bands[i]);
+    }
+    free(mt->bands);
+    free(mt->threads);
+    kitty_buf_destroy(&mt->out);
+    kitty_zlib_mt_init(mt);
 }
 
-static void kitty_poll_events(int millis)
+static void* kitty_zlib_band_run(void *arg)
+{
+    kitty_zlib_band *b = (kitty_zlib_band*)arg;
+    kitty_zlib *kz = &b->z;
+    size_t len = b->src.row_size * b->src.rows;
+    int ret;
+
+    b->ok = 0;
+    b->adler = 1L;
+    if (kitty_zlib_reset(kz, b->level, -MAX_WBITS, b->strategy)) {
+        return NULL;
+    }
+    /* leave room for the empty stored block emitted by the full flush */
+    if (kitty_buf_reserve(&kz->out, deflateBound(&kz->s, len) + 16) < 0) {
+        return NULL;
+    }
+    kz->s.avail_out = kz->out.cap;
+    kz->s.next_out = kz->out.data;
+    for (uint32_t y = 0; y < b->src.rows && b->src.row_size; y++) {
+        const uint8_t *row = b->src.data + y * b->src.stride;
+        b->adler = adler32_z(b->adler, row, b->src.row_size);
+        kz->s.avail_in = b->src.row_size;
+        kz->s.next_in = (uint8_t*)row;
+        if (deflate(&kz->s, Z_NO_FLUSH) != Z_OK) {
+            return NULL;
+        }
+    }
+    ret = deflate(&kz->s, b->last ? Z_FINISH : Z_FULL_FLUSH);
+    if (b->last ? ret != Z_STREAM_END : (ret != Z_OK || kz->s.avail_out == 0)) {
+        return NULL;
+    }
+    kz->out.len = kz->s.total_out;
+    b->ok = 1;
+    return NULL;
+}
+
+static zlib_span kitty_zlib_compress_mt
+    (kitty_zlib_mt *mt, uint32_t nbands, kitty_rows src, uint32_t compression)
 {
-    kdata k;
+    zlib_span result = { NULL, 0 };
+    uint32_t rows = src.rows, band_rows, first;
+    size_t total;
+    int level = kitty_zlib_level(compression);
+    uLong adler;
+    uint8_t *p;
 
+    if (nbands > rows) nbands = rows ? rows : 1;
     /*
-     * loop until we see the image id from kitty acknowledging
-     * the image upload. keypresses can arrive on their own,
-     * or before or after the image id response from kitty.
+     * bands are allocated separately as zlib keeps a pointer back to each
+     * stream, so an initialised band must not move when more are added.
      */
-    do {
-        k = kitty_parse_response(kitty_recv_term(millis));
-        /* handle keypress present at the beginning of the response */
-        if (k.offset == 2) {
-            (*_get_key_callback())(k.data.buf[0]);
-        }
-        /* handle keypress present at the end of the response */
-        if (k.offset == 1) {
-            char *ok = strstr(k.data.buf + k.offset, ";OK\x1B\\");
-            ptrdiff_t ko = (ok != NULL) ? ((ok - k.data.buf) + 5) : 0;
-            if (k.data.r > ko) {
-                (*_get_key_callback())(k.data.buf[ko]);
-            }
+    if (mt->nbands < nbands) {
+        kitty_zlib_band **bands = realloc(mt->bands,
+            sizeof(kitty_zlib_band*) * nbands);
+        pthread_t *threads = realloc(mt->threads, sizeof(pthread_t) * nbands);
+        if (bands) mt->bands = bands;
+        if (threads) mt->threads = threads;
+        if (!bands || !threads) return result;
+        while (mt->nbands < nbands) {
+            kitty_zlib_band *b = malloc(sizeof(kitty_zlib_band));
+            if (!b) return result;
+            kitty_zlib_init(&b->z);
+            mt->bands[mt->nbands++] = b;
+        }
+    }
+
+    /* partition rows evenly, the last band takes the remainder */
+    band_rows = (rows + nbands - 1) / nbands;
+    first = 0;
+    for (uint32_t i = 0; i < nbands; i++) {
+        kitty_zlib_band *b = mt->bands[i];
+        uint32_t n = rows - first < band_rows ? rows - first : band_rows;
+        b->last = (i == nbands - 1);
+        if (b->last) n = rows - first;
+        b->src = (kitty_rows) { src.data + first * src.stride, src.row_size,
+            src.stride, n };
+        if (kitty_rows_contiguous(b->src)) {
+            b->src = kitty_rows_span(b->src.data, src.row_size * n);
+        }
+        b->level = level;
+        b->strategy = kitty_zlib_strategy(compression);
+        first += n;
+    }
+
+    /* the calling thread compresses the last band */
+    for (uint32_t i = 0; i + 1 < nbands; i++) {
+        if (pthread_create(&mt->threads[i], NULL, kitty_zlib_band_run,
+                mt->bands[i])) {
+            kitty_zlib_band_run(mt->bands[i]);
+            mt->threads[i] = pthread_self();
         }
-        /* handle keypress on its own */
-        if (k.offset == 0 && k.data.r == 1) {
-            (*_get_key_callback())(k.data.buf[0]);
+    }
+    kitty_zlib_band_run(mt->bands[nbands - 1]);
+    for (uint32_t i = 0; i + 1 < nbands; i++) {
+        if (!pthread_equal(mt->threads[i], pthread_self())) {
+            pthread_join(mt->threads[i], NULL);
         }
-        /* loop once more for a keypress, if we got our image id */
-    } while (k.iid > 0);
+    }
+
+    total = 6;
+    for (uint32_t i = 0; i < nbands; i++) {
+        if (!mt->bands[i]->ok) return result;
+        total += mt->bands[i]->z.out.len;
+    }
+    if (kitty_buf_reserve(&mt->out, total) < 0) {
+        return result;
+    }
+
+    /* zlib header: 32K window deflate, level hint and header check bits */
+    p = mt->out.data;
+    p[0] = 0x78;
+    p[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    p[1] += 31 - ((p[0] << 8) | p[1]) % 31;
+    p += 2;
+
+    adler = 1L;
+    for (uint32_t i = 0; i < nbands; i++) {
+        kitty_zlib_band *b = mt->bands[i];
+        memcpy(p, b->z.out.data, b->z.out.len);
+        p += b->z.out.len;
+        adler = i == 0 ? b->adler : adler32_combine(adler, b->adler,
+            b->src.row_size * b->src.rows);
+    }
+    p[0] = adler >> 24;
+    p[1] = adler >> 16;
+    p[2] = adler >> 8;
+    p[3] = adler;
+
+    result.data = mt->out.data;
+    result.len = mt->out.len = total;
+
+    return result;
+}
+
+#endif
+
+/*
+ * pixel deflate
+ *
+ * a deflate encoder for rendered frames. generic deflate spends most of
+ * its time searching hash chains, but the redundancy in a rendered frame
+ * is almost all runs of identical pixels and rows identical to the row
+ * above. this looks only for matches at those two distances, measuring
+ * them with vector compares. matches and literals are collected as tokens
+ * and each block of tokens is coded with huffman codes built from their
+ * counts, or the fixed codes when those are smaller. with only two
+ * distances in use the long matches over flat regions code in a few bits.
+ * the output is a standard zlib stream.
+ */
+
+typedef struct kitty_bits {
+    uint8_t *p;
+    uint64_t acc;
+    uint32_t n;
+} kitty_bits;
+
+typedef struct kitty_huff { uint32_t bits; uint32_t n; } kitty_huff;
+
+/* a token is a literal byte, or a match: 0x8000 | length << 1 | above */
+enum { kitty_deflate_tokens = 65536 };
 
+typedef struct kitty_deflate {
+    kitty_buf out;
+    uint16_t *tokens;
+    size_t count;
+} kitty_deflate;
+
+static const uint16_t kitty_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t kitty_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t kitty_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577
+};
+static const uint8_t kitty_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t kitty_clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static void kitty_deflate_destroy(kitty_deflate *kd)
+{
+    kitty_buf_destroy(&kd->out);
+    free(kd->tokens);
+    kd->tokens = NULL;
+}
+
+static uint32_t kitty_bits_reverse(uint32_t code, uint32_t n)
+{
+    uint32_t r = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        r = (r << 1) | ((code >> i) & 1);
+    }
+    return r;
+}
+
+/* length symbol, less 257, for each match length */
+static uint8_t* _get_len_syms()
+{
+    static uint8_t syms[259];
+    static int init;
+
+    if (!init) {
+        for (uint32_t sym = 0; sym < 29; sym++) {
+            uint32_t top = sym == 28 ? 258 : kitty_len_base[sym + 1] - 1;
+            for (uint32_t len = kitty_len_base[sym]; len <= top; len++) {
+                syms[len] = sym;
+            }
+        }
+        init = 1;
+    }
+    return syms;
+}
+
+static uint32_t kitty_dist_sym(uint32_t dist)
+{
+    uint32_t sym = 29;
+    while (kitty_dist_base[sym] > dist) sym--;
+    return sym;
+}
+
+/* fixed huffman code lengths for literal and length symbols */
+static uint32_t kitty_fixed_len(uint32_t sym)
+{
+    return sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+}
+
+/*
+ * huffman code lengths from symbol counts. the tree is built by merging
+ * the sorted leaves with a second queue of merged nodes, and the counts
+ * are halved until no code is longer than limit.
+ */
+static void kitty_huff_lengths
+    (const uint32_t *freq, uint32_t n, uint32_t limit, uint8_t *lens)
+{
+    uint32_t f[288], sym[288], w[576], parent[576];
+    uint8_t depth[576];
+    uint32_t m = 0, max;
+
+    memcpy(f, freq, n * sizeof(uint32_t));
+    for (;;) {
+        m = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            lens[i] = 0;
+            if (!f[i]) continue;
+            /* insertion sort by count, there are at most 286 symbols */
+            uint32_t j = m++;
+            while (j > 0 && f[sym[j - 1]] > f[i]) {
+                sym[j] = sym[j - 1];
+                j--;
+            }
+            sym[j] = i;
+        }
+        if (m == 1) {
+            lens[sym[0]] = 1;
+            return;
+        }
+        for (uint32_t i = 0; i < m; i++) w[i] = f[sym[i]];
+
+        uint32_t leaf = 0, node = m, next = m;
+        while (next < 2 * m - 1) {
+            uint32_t pick[2];
+            for (uint32_t k = 0; k < 2; k++) {
+                if (leaf < m && (node >= next || w[leaf] <= w[node])) {
+                    pick[k] = leaf++;
+                } else {
+                    pick[k] = node++;
+                }
+            }
+            w[next] = w[pick[0]] + w[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = next++;
+        }
+
+        depth[next - 1] = 0;
+        max = 0;
+        for (uint32_t i = next - 1; i-- > 0; ) {
+            depth[i] = depth[parent[i]] + 1;
+            if (i < m && depth[i] > max) max = depth[i];
+        }
+        if (max <= limit) break;
+        for (uint32_t i = 0; i < n; i++) {
+            if (f[i]) f[i] = (f[i] >> 1) | 1;
+        }
+    }
+    for (uint32_t i = 0; i < m; i++) lens[sym[i]] = depth[i];
+}
+
+/* canonical codes from code lengths, bit reversed for the bit writer */
+static void kitty_huff_codes
+    (const uint8_t *lens, uint32_t n, kitty_huff *codes)
+{
+    uint32_t count[16] = { 0 }, next[16], code = 0;
+
+    for (uint32_t i = 0; i < n; i++) count[lens[i]]++;
+    count[0] = 0;
+    for (uint32_t len = 1; len < 16; len++) {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len = lens[i];
+        codes[i] = (kitty_huff) {
+            len ? kitty_bits_reverse(next[len]++, len) : 0, len
+        };
+    }
+}
+
+static inline void kitty_bits_put(kitty_bits *b, uint64_t bits, uint32_t n)
+{
+    b->acc |= bits << b->n;
+    b->n += n;
+    if (b->n >= 32) {
+        b->p[0] = (uint8_t)b->acc;
+        b->p[1] = (uint8_t)(b->acc >> 8);
+        b->p[2] = (uint8_t)(b->acc >> 16);
+        b->p[3] = (uint8_t)(b->acc >> 24);
+        b->p += 4;
+        b->acc >>= 32;
+        b->n -= 32;
+    }
+}
+
+static void kitty_bits_flush(kitty_bits *b)
+{
+    while (b->n > 0) {
+        *b->p++ = (uint8_t)b->acc;
+        b->acc >>= 8;
+        b->n = b->n > 8 ? b->n - 8 : 0;
+    }
+}
+
+/*
+ * code the collected tokens as one block. dist holds the distance of a
+ * run match and of a match with the row above.
+ */
+static void kitty_deflate_block
+    (kitty_deflate *kd, kitty_bits *b, const uint32_t dist[2], int final)
+{
+    uint8_t *len_syms = _get_len_syms();
+    uint32_t lit_freq[286] = { 0 }, dist_freq[30] = { 0 };
+    uint32_t clen_freq[19] = { 0 };
+    uint8_t lens[286 + 30], clen_lens[19], rle[286 + 30][2];
+    kitty_huff lit[286], dst[30], clen[19];
+    uint32_t dist_sym[2], nlit = 257, ndist = 1, nclen = 4, nrle = 0;
+    uint64_t dynamic = 14, fixed = 0;
+
+    dist_sym[0] = kitty_dist_sym(dist[0]);
+    dist_sym[1] = kitty_dist_sym(dist[1]);
+
+    lit_freq[256] = 1;
+    for (size_t i = 0; i < kd->count; i++) {
+        uint32_t t = kd->tokens[i];
+        if (t < 256) {
+            lit_freq[t]++;
+        } else {
+            lit_freq[257 + len_syms[(t >> 1) & 0x1ff]]++;
+            dist_freq[dist_sym[t & 1]]++;
+        }
+    }
+
+    /* the fixed codes cost the same extra bits, so leave them out */
+    for (uint32_t i = 0; i < 286; i++) {
+        fixed += (uint64_t)lit_freq[i] * kitty_fixed_len(i);
+    }
+    for (uint32_t i = 0; i < 30; i++) {
+        fixed += (uint64_t)dist_freq[i] * 5;
+    }
+
+    /* give each code two symbols, some decoders reject a single code */
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < 30; i++) used += dist_freq[i] != 0;
+    for (uint32_t i = 0; used < 2; i++) {
+        if (!dist_freq[i]) dist_freq[i] = 1, used++;
+    }
+    if (kd->count == 0) lit_freq[0] = 1;
+
+    kitty_huff_lengths(lit_freq, 286, 15, lens);
+    kitty_huff_lengths(dist_freq, 30, 15, lens + 286);
+    for (uint32_t i = 257; i < 286; i++) if (lens[i]) nlit = i + 1;
+    for (uint32_t i = 1; i < 30; i++) if (lens[286 + i]) ndist = i + 1;
+    memmove(lens + nlit, lens + 286, ndist);
+
+    /* code lengths, with runs of zeros and repeats run length coded */
+    for (uint32_t i = 0, n = nlit + ndist; i < n; ) {
+        uint32_t l = lens[i], run = 1;
+        while (i + run < n && lens[i + run] == l) run++;
+        if (l == 0 && run >= 3) {
+            run = run > 138 ? 138 : run;
+            rle[nrle][0] = run >= 11 ? 18 : 17;
+            rle[nrle][1] = run >= 11 ? run - 11 : run - 3;
+        } else if (i > 0 && lens[i - 1] == l && run >= 3) {
+            run = run > 6 ? 6 : run;
+            rle[nrle][0] = 16;
+            rle[nrle][1] = run - 3;
+        } else {
+            run = 1;
+            rle[nrle][0] = l;
+            rle[nrle][1] = 0;
+        }
+        clen_freq[rle[nrle++][0]]++;
+        i += run;
+    }
+    if (!clen_freq[0]) clen_freq[0] = 1;
+    if (!clen_freq[18]) clen_freq[18] = 1;
+    kitty_huff_lengths(clen_freq, 19, 7, clen_lens);
+    for (uint32_t i = 4; i < 19; i++) {
+        if (clen_lens[kitty_clen_order[i]]) nclen = i + 1;
+    }
+
+    dynamic += nclen * 3;
+    for (uint32_t i = 0; i < nrle; i++) {
+        uint32_t s = rle[i][0];
+        dynamic += clen_lens[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+    }
+    for (uint32_t i = 0; i < nlit; i++) {
+        dynamic += (uint64_t)lit_freq[i] * lens[i];
+    }
+    for (uint32_t i = 0; i < ndist; i++) {
+        dynamic += (uint64_t)dist_freq[i] * lens[nlit + i];
+    }
+
+    if (dynamic < fixed) {
+        kitty_huff_codes(lens, nlit, lit);
+        kitty_huff_codes(lens + nlit, ndist, dst);
+        kitty_huff_codes(clen_lens, 19, clen);
+        kitty_bits_put(b, final | 2 << 1, 3);
+        kitty_bits_put(b, nlit - 257, 5);
+        kitty_bits_put(b, ndist - 1, 5);
+        kitty_bits_put(b, nclen - 4, 4);
+        for (uint32_t i = 0; i < nclen; i++) {
+            kitty_bits_put(b, clen_lens[kitty_clen_order[i]], 3);
+        }
+        for (uint32_t i = 0; i < nrle; i++) {
+            uint32_t s = rle[i][0];
+            kitty_bits_put(b, clen[s].bits, clen[s].n);
+            if (s >= 16) {
+                kitty_bits_put(b, rle[i][1], s == 16 ? 2 : s == 17 ? 3 : 7);
+            }
+        }
+    } else {
+        /* the fixed codes count the two unused symbols 286 and 287 */
+        uint8_t fixed_lens[288];
+        kitty_huff fixed_lit[288];
+        for (uint32_t i = 0; i < 288; i++) fixed_lens[i] = kitty_fixed_len(i);
+        kitty_huff_codes(fixed_lens, 288, fixed_lit);
+        memcpy(lit, fixed_lit, sizeof(lit));
+        for (uint32_t i = 0; i < 30; i++) {
+            dst[i] = (kitty_huff) { kitty_bits_reverse(i, 5), 5 };
+        }
+        kitty_bits_put(b, final | 1 << 1, 3);
+    }
+
+    /* fold the extra bits into the codes for the two distances */
+    kitty_huff d[2];
+    for (uint32_t k = 0; k < 2; k++) {
+        uint32_t s = dist_sym[k];
+        d[k] = (kitty_huff) {
+            dst[s].bits | (dist[k] - kitty_dist_base[s]) << dst[s].n,
+            dst[s].n + kitty_dist_extra[s]
+        };
+    }
+
+    for (size_t i = 0; i < kd->count; i++) {
+        uint32_t t = kd->tokens[i];
+        if (t < 256) {
+            kitty_bits_put(b, lit[t].bits, lit[t].n);
+        } else {
+            uint32_t len = (t >> 1) & 0x1ff, s = len_syms[len];
+            kitty_huff h = lit[257 + s];
+            kitty_bits_put(b, h.bits | (len - kitty_len_base[s]) << h.n,
+                h.n + kitty_len_extra[s]);
+            kitty_bits_put(b, d[t & 1].bits, d[t & 1].n);
+        }
+    }
+    kitty_bits_put(b, lit[256].bits, lit[256].n);
+    kd->count = 0;
+}
+
+/* number of leading bytes that are equal, up to max */
+static inline size_t kitty_match_len
+    (const uint8_t *a, const uint8_t *b, size_t max)
+{
+    size_t n = 0;
+#if defined(__SSE2__)
+    while (n + 16 <= max) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + n));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + n));
+        uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+        if (m) return n + __builtin_ctz(m);
+        n += 16;
+    }
+#elif defined(__aarch64__)
+    while (n + 16 <= max) {
+        uint64x2_t e = vreinterpretq_u64_u8(
+            vceqq_u8(vld1q_u8(a + n), vld1q_u8(b + n)));
+        uint64_t lo = ~vgetq_lane_u64(e, 0), hi = ~vgetq_lane_u64(e, 1);
+        if (lo) return n + __builtin_ctzll(lo) / 8;
+        if (hi) return n + 8 + __builtin_ctzll(hi) / 8;
+        n += 16;
+    }
+#endif
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+static uint32_t kitty_adler32(uint32_t adler, const uint8_t *p, size_t len)
+{
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+
+    while (len > 0) {
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n >= 4) {
+            a += p[0]; b += a;
+            a += p[1]; b += a;
+            a += p[2]; b += a;
+            a += p[3]; b += a;
+            p += 4;
+            n -= 4;
+        }
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static zlib_span kitty_pixel_deflate
+    (kitty_deflate *kd, kitty_rows src, size_t pixel_size)
+{
+    zlib_span result = { NULL, 0 };
+    size_t row_size = src.row_size, len = row_size * src.rows;
+    /* the row above is only in reach if it is inside the 32K window */
+    int up = row_size >= 3 && row_size <= 32768;
+    uint32_t dist[2] = { (uint32_t)pixel_size, up ? (uint32_t)row_size : 1 };
+    uint16_t *tokens;
+    uint32_t adler = 1;
+    kitty_bits b;
+
+    /*
+     * a block is never larger than with the fixed codes, at most 9 bits
+     * a byte, and each block of tokens covers at least as many bytes.
+     */
+    size_t blocks = len / (kitty_deflate_tokens - 8) + 1;
+    if (kitty_buf_reserve(&kd->out, len / 8 * 9 + blocks * 4 + 32) < 0) {
+        return result;
+    }
+    if (!kd->tokens) {
+        kd->tokens = (uint16_t*)malloc(kitty_deflate_tokens * sizeof(uint16_t));
+        if (!kd->tokens) return result;
+    }
+    tokens = kd->tokens;
+    kd->count = 0;
+
+    kd->out.data[0] = 0x78;
+    kd->out.data[1] = 0x01;
+    b = (kitty_bits) { kd->out.data + 2, 0, 0 };
+
+    for (uint32_t y = 0; y < src.rows; y++) {
+        const uint8_t *row = src.data + y * src.stride;
+        const uint8_t *above = row - src.stride;
+        size_t x = 0;
+        while (x < row_size) {
+            size_t max = row_size - x < 258 ? row_size - x : 258;
+            size_t run = x >= pixel_size ?
+                kitty_match_len(row + x, row + x - pixel_size, max) : 0;
+            size_t vert = up && y > 0 ?
+                kitty_match_len(row + x, above + x, max) : 0;
+            if (kd->count + 8 > kitty_deflate_tokens) {
+                kitty_deflate_block(kd, &b, dist, 0);
+            }
+            if (vert >= 3 && vert >= run) {
+                tokens[kd->count++] = 0x8000 | vert << 1 | 1;
+                x += vert;
+            } else if (run >= 3) {
+                tokens[kd->count++] = 0x8000 | run << 1;
+                x += run;
+            } else {
+                /* no match here, so move on a whole pixel */
+                size_t end = x + pixel_size < row_size ?
+                    x + pixel_size : row_size;
+                for (; x < end; x++) {
+                    tokens[kd->count++] = row[x];
+                }
+            }
+        }
+        adler = kitty_adler32(adler, row, row_size);
+    }
+    kitty_deflate_block(kd, &b, dist, 1);
+
+    kitty_bits_flush(&b);
+    b.p[0] = adler >> 24;
+    b.p[1] = adler >> 16;
+    b.p[2] = adler >> 8;
+    b.p[3] = adler;
+    b.p += 4;
+
+    result.data = kd->out.data;
+    result.len = kd->out.len = b.p - kd->out.data;
+    return result;
+}
+
+/*
+ * automatic compression
+ *
+ * picks the compression mode for each frame with the lowest predicted
+ * time to compress and transmit it. each mode keeps a moving average of
+ * its compression time per input byte and of its output size per input
+ * byte per bit of entropy, so the size can be predicted for a frame from
+ * the byte histogram of a sample of its rows. the link keeps a moving
+ * average of the time to write a byte. modes without measurements are
+ * tried first and each mode is measured again now and then, so a mode
+ * passed over while the link was slow is found again when it is fast.
+ */
+
+enum { kitty_auto_modes = 5, kitty_auto_refresh = 64 };
+
+static const uint32_t kitty_auto_mode[kitty_auto_modes] = {
+    kitty_compress_none, kitty_compress_speed,
+    kitty_compress_rle, kitty_compress_best, kitty_compress_rgba
+};
+
+typedef struct kitty_auto {
+    double ns_per_byte[kitty_auto_modes];
+    double size_per_bit[kitty_auto_modes];
+    uint32_t samples[kitty_auto_modes];
+    uint64_t chosen[kitty_auto_modes];
+    double link_ns_per_byte;
+    double entropy;
+    uint32_t frame;
+    uint32_t choice;
+} kitty_auto;
+
+static void kitty_auto_ewma(double *avg, double sample, uint32_t samples)
+{
+    *avg = samples ? *avg + (sample - *avg) * 0.25 : sample;
+}
+
+/* bits per byte of every 16th row, at least a little so ratios scale */
+static double kitty_auto_entropy(kitty_rows src)
+{
+    uint32_t hist[256] = { 0 };
+    size_t total = 0;
+    double h = 0;
+
+    for (uint32_t y = 0; y < src.rows; y += 16) {
+        const uint8_t *row = src.data + y * src.stride;
+        for (size_t x = 0; x < src.row_size; x++) {
+            hist[row[x]]++;
+        }
+        total += src.row_size;
+    }
+    for (uint32_t i = 0; i < 256 && total; i++) {
+        if (hist[i]) {
+            double p = (double)hist[i] / total;
+            h -= p * log2(p);
+        }
+    }
+    return h < 0.05 ? 0.05 : h;
+}
+
+/* time to write a byte to the terminal, sampled from each write */
+static void kitty_auto_link(kitty_auto *ka, size_t bytes, uint64_t ns)
+{
+    if (bytes < 4096) return;
+    kitty_auto_ewma(&ka->link_ns_per_byte, (double)ns / bytes,
+        ka->link_ns_per_byte > 0);
+}
+
+static uint32_t kitty_auto_choose(kitty_auto *ka, kitty_rows src)
+{
+    size_t len = src.row_size * src.rows;
+    double best = 0;
+    uint32_t choice = 0;
+
+    ka->entropy = kitty_auto_entropy(src);
+    ka->frame++;
+    for (uint32_t i = 0; i < kitty_auto_modes; i++) {
+        /* base64 sends four bytes for every three */
+        double size = i ? len * ka->size_per_bit[i] * ka->entropy : len;
+        double t = len * ka->ns_per_byte[i] +
+            size * 4 / 3 * ka->link_ns_per_byte;
+        if (i && (!ka->samples[i] ||
+                ka->frame % kitty_auto_refresh == i * 16)) {
+            choice = i;
+            break;
+        }
+        if (i == 0 || t < best) {
+            best = t;
+            choice = i;
+        }
+    }
+    ka->choice = choice;
+    ka->chosen[choice]++;
+    return kitty_auto_mode[choice];
+}
+
+static void kitty_auto_update
+    (kitty_auto *ka, size_t len, size_t out, uint64_t ns)
+{
+    uint32_t i = ka->choice;
+    if (!i || !len) return;
+    kitty_auto_ewma(&ka->ns_per_byte[i], (double)ns / len, ka->samples[i]);
+    kitty_auto_ewma(&ka->size_per_bit[i],
+        (double)out / len / ka->entropy, ka->samples[i]);
+    ka->samples[i]++;
+}
+
+/*
+ * latency histograms
+ *
+ * log-linear histograms in the style of HDR histogram. values below 32
+ * have a bucket each and every power of two above is split into 32 linear
+ * buckets, so any value is reported to within about 3% in constant space
+ * and recording is a count leading zeros and an increment.
+ */
+
+enum {
+    kitty_hist_sub_bits = 5,
+    kitty_hist_sub = 1 << kitty_hist_sub_bits,
+    kitty_hist_buckets = (64 - kitty_hist_sub_bits + 1) * kitty_hist_sub
+};
+
+typedef struct kitty_hist {
+    uint32_t counts[kitty_hist_buckets];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} kitty_hist;
+
+static inline uint32_t kitty_hist_index(uint64_t v)
+{
+    uint32_t exp;
+
+    if (v < kitty_hist_sub) return (uint32_t)v;
+    exp = 63 - __builtin_clzll(v);
+    return (exp - kitty_hist_sub_bits + 1) * kitty_hist_sub +
+        (uint32_t)((v >> (exp - kitty_hist_sub_bits)) & (kitty_hist_sub - 1));
+}
+
+/* the highest value that falls in a bucket */
+static uint64_t kitty_hist_value(uint32_t idx)
+{
+    uint32_t exp, sub;
+
+    if (idx < kitty_hist_sub) return idx;
+    exp = idx / kitty_hist_sub + kitty_hist_sub_bits - 1;
+    sub = idx % kitty_hist_sub;
+    return (((uint64_t)kitty_hist_sub + sub + 1) <<
+        (exp - kitty_hist_sub_bits)) - 1;
+}
+
+static void kitty_hist_record(kitty_hist *h, uint64_t v)
+{
+    h->counts[kitty_hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static uint64_t kitty_hist_percentile(kitty_hist *h, double p)
+{
+    uint64_t target, seen = 0;
+
+    if (!h->count) return 0;
+    target = (uint64_t)ceil(p / 100. * h->count);
+    if (target < 1) target = 1;
+    for (uint32_t i = 0; i < kitty_hist_buckets; i++) {
+        if ((seen += h->counts[i]) >= target) {
+            uint64_t v = kitty_hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static double kitty_hist_mean(kitty_hist *h)
+{
+    return h->count ? (double)h->sum / h->count : 0.;
+}
+
+/*
+ * frame stages
+ *
+ * the time a frame spends in each stage is the sum of its spans, which
+ * are recorded in the stage histogram when the stage is finished for the
+ * frame. stages run on different threads when frames are pipelined, so
+ * each stage must only be added to and committed from one thread.
+ */
+
+enum kitty_stage {
+    kitty_stage_render,
+    kitty_stage_flip,
+    kitty_stage_compress,
+    kitty_stage_base64,
+    kitty_stage_write,
+    kitty_stage_poll,
+    kitty_stage_count
+};
+
+static const char* kitty_stage_names[kitty_stage_count] = {
+    "render", "flip", "compress", "base64", "write", "poll"
+};
+
+typedef struct kitty_stages {
+    uint64_t frame_ns[kitty_stage_count];
+    uint32_t spans[kitty_stage_count];
+    kitty_hist hist[kitty_stage_count];
+} kitty_stages;
+
+static void kitty_stage_add(kitty_stages *st, int stage, uint64_t ns)
+{
+    st->frame_ns[stage] += ns;
+    st->spans[stage]++;
+}
+
+static void kitty_stage_commit(kitty_stages *st, int stage)
+{
+    if (!st->spans[stage]) return;
+    kitty_hist_record(&st->hist[stage], st->frame_ns[stage]);
+    st->frame_ns[stage] = 0;
+    st->spans[stage] = 0;
+}
+
+/* stages that encode a frame into its output */
+static void kitty_stage_commit_encode(kitty_stages *st)
+{
+    kitty_stage_commit(st, kitty_stage_flip);
+    kitty_stage_commit(st, kitty_stage_compress);
+    kitty_stage_commit(st, kitty_stage_base64);
+}
+
+/*
+ * stream recording
+ *
+ * records the bytes written to the terminal frame by frame in a container
+ * that can be memory mapped and replayed. the header is followed by the
+ * frame data back to back and then an index with the offset, length, time
+ * and stage timings of each frame. the header is rewritten on close with
+ * the frame count and the offset of the index. fields are in host order.
+ * a failed write leaves the offsets in the index wrong, so it is latched
+ * and reported when the recording is closed.
+ */
+
+enum { kitty_record_version = 1 };
+
+static const char kitty_record_magic[8] = { 'K','I','T','T','Y','R','E','C' };
+
+typedef struct kitty_record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t frames;
+    uint64_t index_offset;
+    uint64_t duration_ns;
+} kitty_record_header;
+
+typedef struct kitty_record_frame {
+    uint64_t offset;
+    uint64_t len;
+    uint64_t time_ns;
+    uint64_t render_ns;
+    uint64_t encode_ns;
+    uint64_t write_ns;
+} kitty_record_frame;
+
+typedef struct kitty_recorder {
+    FILE *file;
+    uint64_t offset;
+    uint64_t start_ns;
+    kitty_buf index;
+    int error;
+} kitty_recorder;
+
+static int kitty_record_open(kitty_recorder *kr, const char *path)
+{
+    kitty_record_header h = { 0 };
+
+    memset(kr, 0, sizeof(kitty_recorder));
+    if (!(kr->file = fopen(path, "wb"))) {
+        return -1;
+    }
+    /* the header is a placeholder until the index is written */
+    if (fwrite(&h, sizeof(h), 1, kr->file) != 1) {
+        fclose(kr->file);
+        kr->file = NULL;
+        return -1;
+    }
+    kr->offset = sizeof(h);
+    kr->start_ns = kitty_clock_ns();
+    return 0;
+}
+
+/*
+ * append a frame. f carries the time the frame started to be written and
+ * its stage timings, the offset and length are filled in here.
+ */
+static int kitty_record_write(kitty_recorder *kr, const uint8_t *data,
+    size_t len, kitty_record_frame f)
+{
+    if (!kr->file || !len) return 0;
+    if (kr->error) return -1;
+    f.offset = kr->offset;
+    f.len = len;
+    f.time_ns = f.time_ns > kr->start_ns ? f.time_ns - kr->start_ns : 0;
+    if (fwrite(data, len, 1, kr->file) != 1 ||
+        kitty_buf_append(&kr->index, &f, sizeof(f)) < 0) {
+        kr->error = 1;
+        return -1;
+    }
+    kr->offset += len;
+    return 0;
+}
+
+static int kitty_record_close(kitty_recorder *kr)
+{
+    kitty_record_header h;
+    int ret = kr->error ? -1 : 0;
+
+    if (!kr->file) return ret;
+    memcpy(h.magic, kitty_record_magic, sizeof(h.magic));
+    h.version = kitty_record_version;
+    h.frames = (uint32_t)(kr->index.len / sizeof(kitty_record_frame));
+    h.index_offset = kr->offset;
+    h.duration_ns = kitty_clock_ns() - kr->start_ns;
+    if (fwrite(kr->index.data, 1, kr->index.len, kr->file) != kr->index.len ||
+        fseek(kr->file, 0, SEEK_SET) < 0 ||
+        fwrite(&h, sizeof(h), 1, kr->file) != 1) {
+        ret = -1;
+    }
+    if (fclose(kr->file) != 0) ret = -1;
+    kr->file = NULL;
+    kitty_buf_destroy(&kr->index);
+    return ret;
+}
+
+/*
+ * kitty session
+ *
+ * per-session transmission state and statistics used by kitty_send_rgba.
+ */
+
+/*
+ * kitty transmission mediums
+ *
+ * direct sends base64 data inline in escape sequences, shared memory
+ * sends the name of a POSIX shared memory object holding the data, and
+ * temporary file sends the path of a file the terminal reads and deletes.
+ */
+
+enum kitty_medium {
+    kitty_medium_direct = 'd',
+    kitty_medium_shm = 's',
+    kitty_medium_file = 't'
+};
+
+enum { kitty_file_ring = 64, kitty_out_ring = 8 };
+
+typedef struct kitty_session {
+    uint32_t compression;
+    uint32_t threads;
+    uint32_t quiet;
+    char medium;
+    uint32_t medium_seq;
+    uint32_t medium_fallbacks;
+    const char *file_dir;
+    uint32_t file_limit;
+    uint32_t file_seqs[kitty_file_ring];
+    uint32_t file_head;
+    uint32_t file_count;
+    uint32_t file_peak;
+    uint32_t file_overflows;
+#ifdef HAVE_ZLIB
+    kitty_zlib z;
+    kitty_zlib_mt zmt;
+#endif
+    kitty_deflate deflate;
+    int out_fd;
+    kitty_buf *sink;
+    kitty_buf frame;
+    kitty_buf rect;
+    uint64_t write_calls;
+    uint64_t write_bytes;
+    kitty_buf out_bufs[kitty_out_ring];
+    uint8_t out_droppable[kitty_out_ring];
+    kitty_record_frame out_record[kitty_out_ring];
+    uint32_t out_head;
+    uint32_t out_count;
+    size_t out_offset;
+    size_t out_bytes;
+    size_t out_budget;
+    size_t out_peak;
+    uint64_t out_dropped;
+    int out_flags;
+    uint64_t out_start_ns;
+    uint64_t compress_ns;
+    uint64_t compress_frames;
+    kitty_auto autoc;
+    kitty_recorder *record;
+    uint64_t render_ns;
+    uint64_t frame_begin_ns;
+    kitty_stages stages;
+} kitty_session;
+
+static void kitty_session_init(kitty_session *ks, uint32_t compression)
+{
+    memset(ks, 0, sizeof(kitty_session));
+    ks->compression = compression;
+    ks->threads = 1;
+    ks->medium = kitty_medium_direct;
+    ks->file_dir = "/dev/shm";
+    ks->file_limit = 16;
+    ks->out_fd = fileno(stdout);
+#ifdef HAVE_ZLIB
+    kitty_zlib_init(&ks->z);
+    kitty_zlib_mt_init(&ks->zmt);
+#endif
+}
+
+static void kitty_file_path(kitty_session *ks, char *path, size_t len,
+    uint32_t seq);
+
+static void kitty_session_destroy(kitty_session *ks)
+{
+    /* remove temporary files the terminal did not consume */
+    for (uint32_t i = 0; i < ks->file_count; i++) {
+        char path[256];
+        kitty_file_path(ks, path, sizeof(path),
+            ks->file_seqs[(ks->file_head + i) % kitty_file_ring]);
+        unlink(path);
+    }
+    ks->file_count = 0;
+    kitty_buf_destroy(&ks->frame);
+    kitty_buf_destroy(&ks->rect);
+    for (uint32_t i = 0; i < kitty_out_ring; i++) {
+        kitty_buf_destroy(&ks->out_bufs[i]);
+    }
+#ifdef HAVE_ZLIB
+    kitty_zlib_destroy(&ks->z);
+    kitty_zlib_mt_destroy(&ks->zmt);
+#endif
+    kitty_deflate_destroy(&ks->deflate);
+}
+
+/*
+ * session output goes to stdout, or is appended to the sink buffer when
+ * one is set, so frames can be encoded on one thread and written on another.
+ */
+static void kitty_session_write(kitty_session *ks, const void *data, size_t len)
+{
+    if (ks->sink) {
+        if (kitty_buf_append(ks->sink, data, len) < 0) {
+            fprintf(stderr, "error: kitty_buf_append failed\n");
+            exit(1);
+        }
+    } else {
+        fwrite(data, len, 1, stdout);
+    }
+}
+
+static void kitty_session_flush(kitty_session *ks)
+{
+    if (!ks->sink) {
+        fflush(stdout);
+    }
+}
+
+/*
+ * write a buffer to a file descriptor with as few system calls as the
+ * descriptor allows, retrying partial and interrupted writes.
+ */
+static int kitty_write_all
+    (kitty_session *ks, int fd, const uint8_t *data, size_t len)
+{
+    uint64_t t0 = kitty_clock_ns();
+    size_t total = len;
+
+    while (len > 0) {
+        ssize_t r = write(fd, data, len);
+        ks->write_calls++;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        ks->write_bytes += r;
+        data += r;
+        len -= r;
+    }
+    uint64_t ns = kitty_clock_ns() - t0;
+    kitty_auto_link(&ks->autoc, total, ns);
+    kitty_stage_add(&ks->stages, kitty_stage_write, ns);
+    return 0;
+}
+
+/*
+ * output queue
+ *
+ * with a byte budget set, the output descriptor, stdout unless set, is
+ * made non-blocking and finished frames are queued and written as the
+ * terminal accepts them, so a slow terminal does not stall rendering or
+ * input handling. when the unsent frames go over budget the newest frame
+ * wins: frames that have not started to be written are dropped, except
+ * the newest and any that later frames depend on. a partially written
+ * frame is always finished.
+ */
+
+static int kitty_out_pump(kitty_session *ks)
+{
+    int fd = ks->out_fd;
+
+    while (ks->out_count > 0) {
+        kitty_buf *b = &ks->out_bufs[ks->out_head];
+        uint64_t t0 = kitty_clock_ns();
+        ssize_t r = write(fd, b->data + ks->out_offset,
+            b->len - ks->out_offset);
+        kitty_stage_add(&ks->stages, kitty_stage_write, kitty_clock_ns() - t0);
+        ks->write_calls++;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+        ks->write_bytes += r;
+        ks->out_offset += r;
+        ks->out_bytes -= r;
+        if (ks->out_offset == b->len) {
+            /* the link was busy with this frame since it reached the head */
+            uint64_t now = kitty_clock_ns();
+            kitty_auto_link(&ks->autoc, b->len, now - ks->out_start_ns);
+            kitty_stage_commit(&ks->stages, kitty_stage_write);
+            if (ks->record) {
+                kitty_record_frame *f = &ks->out_record[ks->out_head];
+                f->time_ns = ks->out_start_ns;
+                f->write_ns = now - ks->out_start_ns;
+                kitty_record_write(ks->record, b->data, b->len, *f);
+            }
+            ks->out_start_ns = now;
+            ks->out_head = (ks->out_head + 1) % kitty_out_ring;
+            ks->out_count--;
+            ks->out_offset = 0;
+        }
+    }
+    return 0;
+}
+
+static void kitty_out_drop(kitty_session *ks)
+{
+    kitty_buf keep[kitty_out_ring], spare[kitty_out_ring];
+    kitty_record_frame record[kitty_out_ring];
+    uint8_t droppable[kitty_out_ring];
+    uint32_t nkeep = 0, nspare = 0;
+
+    for (uint32_t i = 0; i < kitty_out_ring; i++) {
+        uint32_t idx = (ks->out_head + i) % kitty_out_ring;
+        int started = i == 0 && ks->out_offset > 0;
+        int newest = i + 1 == ks->out_count;
+        if (i >= ks->out_count) {
+            spare[nspare++] = ks->out_bufs[idx];
+        } else if (ks->out_droppable[idx] && !started && !newest) {
+            ks->out_bytes -= ks->out_bufs[idx].len;
+            ks->out_dropped++;
+            spare[nspare++] = ks->out_bufs[idx];
+        } else {
+            droppable[nkeep] = ks->out_droppable[idx];
+            record[nkeep] = ks->out_record[idx];
+            keep[nkeep++] = ks->out_bufs[idx];
+        }
+    }
+    /* buffers are moved rather than freed so their memory is reused */
+    memcpy(ks->out_bufs, keep, nkeep * sizeof(kitty_buf));
+    memcpy(ks->out_bufs + nkeep, spare, nspare * sizeof(kitty_buf));
+    memcpy(ks->out_droppable, droppable, nkeep);
+    memcpy(ks->out_record, record, nkeep * sizeof(kitty_record_frame));
+    ks->out_head = 0;
+    ks->out_count = nkeep;
+}
+
+static int kitty_out_wait(kitty_session *ks, int timeout)
+{
+    struct pollfd pfd = { ks->out_fd, POLLOUT, 0 };
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+        return -1;
+    }
+    return kitty_out_pump(ks);
+}
+
+static void kitty_out_init(kitty_session *ks, size_t budget)
+{
+    int fd = ks->out_fd;
+
+    ks->out_budget = budget;
+    fflush(stdout);
+    if ((ks->out_flags = fcntl(fd, F_GETFL)) >= 0) {
+        fcntl(fd, F_SETFL, ks->out_flags | O_NONBLOCK);
+    }
+}
+
+/* write all queued frames and restore blocking output */
+static void kitty_out_finish(kitty_session *ks)
+{
+    if (!ks->out_budget) return;
+    while (ks->out_count > 0) {
+        if (kitty_out_wait(ks, -1) < 0) break;
+    }
+    if (ks->out_flags >= 0) {
+        fcntl(ks->out_fd, F_SETFL, ks->out_flags);
+    }
+    ks->out_budget = 0;
+}
+
+/*
+ * frame output
+ *
+ * everything a frame sends, from the cursor move to the last chunk
+ * trailer, is built in one buffer owned by the session and written with
+ * a single system call once the frame is complete, or queued if there is
+ * an output budget. droppable frames may be skipped under backpressure,
+ * unless they name an shm object or file that only the terminal removes.
+ */
+static void kitty_frame_begin(kitty_session *ks, int droppable)
+{
+    uint32_t idx;
+
+    if (!ks->out_budget) {
+        ks->frame.len = 0;
+        ks->sink = &ks->frame;
+        ks->frame_begin_ns = kitty_clock_ns();
+        return;
+    }
+    if (ks->out_count == kitty_out_ring) {
+        kitty_out_drop(ks);
+    }
+    while (ks->out_count == kitty_out_ring) {
+        if (kitty_out_wait(ks, -1) < 0) {
+            fprintf(stderr, "error: write failed\n");
+            exit(1);
+        }
+    }
+    idx = (ks->out_head + ks->out_count) % kitty_out_ring;
+    ks->out_bufs[idx].len = 0;
+    ks->out_droppable[idx] = droppable &&
+        ks->medium == kitty_medium_direct;
+    ks->sink = &ks->out_bufs[idx];
+    ks->frame_begin_ns = kitty_clock_ns();
+}
+
+static int kitty_frame_end(kitty_session *ks)
+{
+    kitty_buf *b = ks->sink;
+    uint64_t now = kitty_clock_ns();
+    kitty_record_frame f = { 0, 0, now, ks->render_ns,
+        now - ks->frame_begin_ns, 0 };
+    int ret;
+
+    ks->sink = NULL;
+    kitty_stage_commit_encode(&ks->stages);
+    if (!ks->out_budget) {
+        /* anything buffered by stdio must go out first */
+        fflush(stdout);
+        ret = kitty_write_all(ks, ks->out_fd, b->data, b->len);
+        kitty_stage_commit(&ks->stages, kitty_stage_write);
+        if (ks->record) {
+            f.write_ns = kitty_clock_ns() - now;
+            kitty_record_write(ks->record, b->data, b->len, f);
+        }
+        return ret;
+    }
+    if (b->len == 0) {
+        return 0;
+    }
+    ks->out_record[(ks->out_head + ks->out_count) % kitty_out_ring] = f;
+    if (ks->out_count++ == 0) {
+        ks->out_start_ns = kitty_clock_ns();
+    }
+    ks->out_bytes += b->len;
+    if (ks->out_bytes > ks->out_peak) {
+        ks->out_peak = ks->out_bytes;
+    }
+    if (ks->out_bytes > ks->out_budget) {
+        kitty_out_drop(ks);
+    }
+    return kitty_out_pump(ks);
+}
+
+/*
+ * kitty chunked transmission
+ *
+ * base64 encodes one chunk at a time into a reusable buffer together with
+ * the escape header and trailer, so memory use is constant irrespective of
+ * frame size. 3072 input bytes encode to exactly 4096 base64 bytes, so the
+ * chunk boundaries are the same as encoding the whole frame up front.
+ *
+ * <ESC>_G<pre>m=1<post>;<encoded data first chunk><ESC>\
+ * <ESC>_Gm=1;<encoded data second chunk><ESC>\
+ * <ESC>_Gm=0;<encoded data last chunk><ESC>\
+ */
+
+enum {
+    kitty_chunk_limit = 4096,
+    kitty_chunk_input = kitty_chunk_limit / 4 * 3,
+    kitty_chunk_header = 128
+};
+
+static void kitty_send_chunks_rows
+    (kitty_session *ks, const char *pre, const char *post, kitty_rows src)
+{
+    char stack[kitty_chunk_header + kitty_chunk_limit + 3], *chunk = stack;
+    uint8_t gather[kitty_chunk_input];
+    size_t len = src.row_size * src.rows, offset = 0, x = 0;
+    uint64_t t0 = kitty_clock_ns();
+    uint32_t y = 0;
+
+    while (offset < len) {
+        size_t in_size = len - offset < kitty_chunk_input
+            ? len - offset : kitty_chunk_input;
+        int cont = !!(offset + in_size < len);
+        const uint8_t *in = src.data + y * src.stride + x;
+        int hlen, ret;
+
+        /* chunks that cross a row boundary are gathered first */
+        if (x + in_size <= src.row_size) {
+            x += in_size;
+        } else {
+            for (size_t n = 0; n < in_size; ) {
+                size_t c = src.row_size - x < in_size - n
+                    ? src.row_size - x : in_size - n;
+                memcpy(gather + n, src.data + y * src.stride + x, c);
+                n += c;
+                x += c;
+                if (x == src.row_size) {
+                    x = 0;
+                    y++;
+                }
+            }
+            in = gather;
+        }
+        if (x == src.row_size) {
+            x = 0;
+            y++;
+        }
+
+        /* chunks are encoded in place when output goes to a buffer */
+        if (ks->sink) {
+            if (kitty_buf_grow(ks->sink, sizeof(stack)) < 0) {
+                fprintf(stderr, "error: kitty_buf_grow failed\n");
+                exit(1);
+            }
+            chunk = (char*)ks->sink->data + ks->sink->len;
+        }
+        if (offset == 0) {
+            hlen = snprintf(chunk, kitty_chunk_header, "\x1B_G%sm=%d%s;",
+                pre, cont, post);
+        } else {
+            hlen = snprintf(chunk, kitty_chunk_header, "\x1B_Gm=%d;", cont);
+        }
+        ret = base64_encode(in_size, in, kitty_chunk_limit + 1, chunk + hlen);
+        if (ret < 0) {
+            fprintf(stderr, "error: base64_encode failed: ret=%d\n", ret);
+            exit(1);
+        }
+        memcpy(chunk + hlen + ret, "\x1B\\", 2);
+        if (ks->sink) {
+            ks->sink->len += hlen + ret + 2;
+        } else {
+            kitty_session_write(ks, chunk, hlen + ret + 2);
+        }
+        offset += in_size;
+    }
+    kitty_stage_add(&ks->stages, kitty_stage_base64, kitty_clock_ns() - t0);
+}
+
+static void kitty_send_chunks
+    (kitty_session *ks, const char *pre, const char *post,
+    const uint8_t *data, size_t len)
+{
+    kitty_send_chunks_rows(ks, pre, post, kitty_rows_span(data, len));
+}
+
+/*
+ * kitty indirect transmission
+ *
+ * the payload of an indirect transmission is the base64 encoded name of
+ * the object holding the data, which is small enough for a single escape.
+ *
+ * <ESC>_G<ctl>;<encoded object name><ESC>\
+ */
+
+static void kitty_send_path(kitty_session *ks, const char *ctl, const char *path)
+{
+    char buf[kitty_chunk_header + 512];
+    size_t path_len = strlen(path);
+    int hlen, ret;
+
+    hlen = snprintf(buf, kitty_chunk_header, "\x1B_G%s;", ctl);
+    ret = base64_encode(path_len, (const uint8_t*)path,
+        sizeof(buf) - hlen - 2, buf + hlen);
+    if (ret < 0) {
+        fprintf(stderr, "error: base64_encode failed: ret=%d\n", ret);
+        exit(1);
+    }
+    memcpy(buf + hlen + ret, "\x1B\\", 2);
+    kitty_session_write(ks, buf, hlen + ret + 2);
+}
+
+/*
+ * kitty shared memory
+ *
+ * the terminal unlinks the shared memory object after reading it, so each
+ * frame is written to a new uniquely named object.
+ */
+
+static int kitty_shm_write(const char *name, const uint8_t *data, size_t len)
+{
+    int fd, ret = -1;
+    void *p;
+
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, len) == 0) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            memcpy(p, data, len);
+            munmap(p, len);
+            ret = 0;
+        }
+    }
+    close(fd);
+    if (ret < 0) {
+        shm_unlink(name);
+    }
+    return ret;
+}
+
+/*
+ * kitty temporary files
+ *
+ * the terminal only deletes files in a temporary directory whose path
+ * contains "tty-graphics-protocol". files the terminal has not read yet
+ * are tracked in a ring so the directory is not flooded when the terminal
+ * falls behind. the terminal reads files in order, so the ring is pruned
+ * from the oldest entry until one that still exists is found.
+ */
+
+static void kitty_file_path(kitty_session *ks, char *path, size_t len,
+    uint32_t seq)
+{
+    snprintf(path, len, "%s/glkitty-tty-graphics-protocol-%d-%u",
+        ks->file_dir, (int)getpid(), seq);
+}
+
+static int kitty_file_write(const char *path, const uint8_t *data, size_t len)
+{
+    size_t off = 0;
+    ssize_t r;
+    int fd;
+
+    if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0600)) < 0) {
+        return -1;
+    }
+    while (off < len) {
+        if ((r = write(fd, data + off, len - off)) < 0) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        off += r;
+    }
+    close(fd);
+    return 0;
+}
+
+static uint32_t kitty_file_outstanding(kitty_session *ks)
+{
+    char path[256];
+
+    while (ks->file_count > 0) {
+        kitty_file_path(ks, path, sizeof(path), ks->file_seqs[ks->file_head]);
+        if (access(path, F_OK) == 0) break;
+        ks->file_head = (ks->file_head + 1) % kitty_file_ring;
+        ks->file_count--;
+    }
+    return ks->file_count;
+}
+
+/*
+ * write data to a new object for the current indirect medium. returns 0
+ * on success, -1 if the medium failed, or -2 if too many temporary files
+ * are outstanding and this frame should be sent directly instead.
+ */
+static int kitty_medium_write(kitty_session *ks, char *path, size_t len,
+    const uint8_t *data, size_t size, int track)
+{
+    uint32_t seq = ks->medium_seq++;
+    uint32_t limit = ks->file_limit < kitty_file_ring ?
+        ks->file_limit : kitty_file_ring;
+
+    switch (ks->medium) {
+    case kitty_medium_shm:
+        snprintf(path, len, "/glkitty-%d-%u", (int)getpid(), seq);
+        return kitty_shm_write(path, data, size);
+    case kitty_medium_file:
+        if (track && kitty_file_outstanding(ks) >= limit) {
+            return -2;
+        }
+        kitty_file_path(ks, path, len, seq);
+        if (kitty_file_write(path, data, size) < 0) {
+            return -1;
+        }
+        if (track) {
+            ks->file_seqs[(ks->file_head + ks->file_count++) %
+                kitty_file_ring] = seq;
+            if (ks->file_count > ks->file_peak) {
+                ks->file_peak = ks->file_count;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static void kitty_medium_unlink(kitty_session *ks, const char *path)
+{
+    switch (ks->medium) {
+    case kitty_medium_shm: shm_unlink(path); break;
+    case kitty_medium_file: unlink(path); break;
+    }
+}
+
+/*
+ * kitty image protocol
+ *
+ * outputs base64 encoding of image data
+ */
+
+enum kitty_format {
+    kitty_format_rgb = 24,
+    kitty_format_rgba = 32
+};
+
+/*
+ * send pixel rows with the given control keys, compressing them first if
+ * enabled and using the indirect medium if one is selected.
+ */
+static size_t kitty_send_pixels
+    (kitty_session *ks, const char *keys, uint32_t format, kitty_rows src)
+{
+    uint32_t compression = ks->compression;
+    size_t total_size = src.row_size * src.rows;
+
+#ifdef HAVE_ZLIB
+    if (compression == kitty_compress_auto) {
+        compression = kitty_auto_choose(&ks->autoc, src);
+    }
+#else
+    /* only the built in pixel encoder is available without zlib */
+    if (compression != kitty_compress_rgba) {
+        compression = kitty_compress_none;
+    }
+#endif
+    kitty_rows encode = src;
+    char pre[128];
+
+    /*
+     * q=1 asks the terminal to only respond with errors, q=2 not at all.
+     */
+    const char *quiet = ks->quiet == 1 ? ",q=1" : ks->quiet ? ",q=2" : "";
+
+#define COMPRESSION_STRING (compression ? ",o=z" : "")
+
+    /*
+     * if compression is enabled, compress data before base64 encoding.
+     */
+    zlib_span z;
+    if (compression) {
+        uint64_t t0 = kitty_clock_ns();
+        if (compression == kitty_compress_rgba) {
+            z = kitty_pixel_deflate(&ks->deflate, src, format >> 3);
+        }
+#ifdef HAVE_ZLIB
+        else if (ks->threads > 1) {
+            z = kitty_zlib_compress_mt(&ks->zmt, ks->threads, src,
+                compression);
+        } else if (!kitty_rows_contiguous(src)) {
+            z = kitty_zlib_compress_rows(&ks->z, src, compression);
+        } else {
+            z = kitty_zlib_compress(&ks->z, src.data, total_size,
+                compression);
+        }
+#endif
+        if (!z.data) return 0;
+        encode = kitty_rows_span(z.data, z.len);
+        if (ks->compression == kitty_compress_auto) {
+            kitty_auto_update(&ks->autoc, total_size, z.len,
+                kitty_clock_ns() - t0);
+        }
+        uint64_t ns = kitty_clock_ns() - t0;
+        ks->compress_ns += ns;
+        ks->compress_frames++;
+        kitty_stage_add(&ks->stages, kitty_stage_compress, ns);
+    }
+
+    /*
+     * write kitty protocol image to a shared memory object or file
+     * and send its name, falling back to direct transmission if that fails.
+     */
+    if (ks->medium != kitty_medium_direct) {
+        char path[256], ctl[192];
+        size_t encode_size = encode.row_size * encode.rows;
+        if (!kitty_rows_contiguous(encode)) {
+            if (kitty_rows_gather(&ks->rect, encode) < 0) return 0;
+            encode = kitty_rows_span(ks->rect.data, ks->rect.len);
+        }
+        int ret = kitty_medium_write(ks, path, sizeof(path),
+            encode.data, encode_size, 1);
+        if (ret == 0) {
+            snprintf(ctl, sizeof(ctl), "%s%s,t=%c,S=%zu%s",
+                keys, quiet, ks->medium, encode_size, COMPRESSION_STRING);
+            kitty_send_path(ks, ctl, path);
+            kitty_session_flush(ks);
+            return encode_size;
+        } else if (ret == -2) {
+            ks->file_overflows++;
+        } else {
+            ks->medium = kitty_medium_direct;
+            ks->medium_fallbacks++;
+        }
+    }
+
+    /*
+     * write kitty protocol image in chunks no greater than 4096 bytes
+     */
+    snprintf(pre, sizeof(pre), "%s%s,", keys, quiet);
+    kitty_send_chunks_rows(ks, pre, COMPRESSION_STRING, encode);
+    kitty_session_flush(ks);
+
+    return encode.row_size * encode.rows;
+}
+
+static size_t kitty_send_image_rows
+    (kitty_session *ks, char cmd, uint32_t id, uint32_t format,
+    kitty_rows src, uint32_t width)
+{
+    char keys[96];
+
+    snprintf(keys, sizeof(keys), "f=%u,a=%c,i=%u,s=%d,v=%d",
+        format, cmd, id, width, src.rows);
+    return kitty_send_pixels(ks, keys, format, src);
+}
+
+static size_t kitty_send_image
+    (kitty_session *ks, char cmd, uint32_t id, uint32_t format,
+    const uint8_t *color_pixels, uint32_t width, uint32_t height)
+{
+    size_t row_size = width * (format >> 3);
+    kitty_rows src = { color_pixels, row_size, (ptrdiff_t)row_size, height };
+
+    return kitty_send_image_rows(ks, cmd, id, format, src, width);
+}
+
+/*
+ * send an image rendered bottom up, as OpenGL does, reading its rows from
+ * the last to the first so the frame is not flipped in a separate pass.
+ */
+static size_t kitty_send_image_flip
+    (kitty_session *ks, char cmd, uint32_t id, uint32_t format,
+    const uint8_t *color_pixels, uint32_t width, uint32_t height)
+{
+    size_t row_size = width * (format >> 3);
+    kitty_rows src = { color_pixels + (height ? height - 1 : 0) * row_size,
+        row_size, -(ptrdiff_t)row_size, height };
+
+    return kitty_send_image_rows(ks, cmd, id, format, src, width);
+}
+
+static size_t kitty_send_rgba
+    (kitty_session *ks, char cmd, uint32_t id,
+    const uint8_t *color_pixels, uint32_t width, uint32_t height)
+{
+    return kitty_send_image(ks, cmd, id, kitty_format_rgba,
+        color_pixels, width, height);
+}
+
+/*
+ * dirty rectangles
+ *
+ * frames are compared row by row and the changed rows are grouped into
+ * rectangles spanning their changed columns. runs of changed rows that
+ * are separated by fewer than gap unchanged rows are merged, as each
+ * rectangle costs a command and a compression stream of its own.
+ */
+
+typedef struct kitty_rect { uint32_t x, y, w, h; } kitty_rect;
+
+static size_t kitty_diff_rects
+    (kitty_rect *rects, size_t max_rects, const uint8_t *prev,
+    const uint8_t *next, size_t pixel_size, uint32_t width, uint32_t height,
+    uint32_t gap)
+{
+    size_t row_size = width * pixel_size, n = 0;
+    uint32_t x0 = 0, x1 = 0, y0 = 0, last = 0;
+    int open = 0;
+
+    for (uint32_t y = 0; y < height && max_rects > 0; y++) {
+        const uint8_t *p = prev + y * row_size, *q = next + y * row_size;
+        uint32_t l = 0, r = width;
+        if (memcmp(p, q, row_size) == 0) continue;
+        while (!memcmp(p + l * pixel_size, q + l * pixel_size, pixel_size)) {
+            l++;
+        }
+        while (!memcmp(p + (r-1) * pixel_size, q + (r-1) * pixel_size,
+                pixel_size)) {
+            r--;
+        }
+        /* the last rectangle absorbs everything once the array is full */
+        if (open && y - last > gap && n + 1 < max_rects) {
+            rects[n++] = (kitty_rect) { x0, y0, x1 - x0, last + 1 - y0 };
+            open = 0;
+        }
+        if (!open) {
+            x0 = l; x1 = r; y0 = y; open = 1;
+        } else {
+            if (l < x0) x0 = l;
+            if (r > x1) x1 = r;
+        }
+        last = y;
+    }
+    if (open) {
+        rects[n++] = (kitty_rect) { x0, y0, x1 - x0, last + 1 - y0 };
+    }
+    return n;
+}
+
+/*
+ * send a rectangle of a frame as an image. rows are read straight from
+ * the frame, which is stride bytes per row, bottom up if it is negative.
+ * keys are the control keys besides the format and size.
+ */
+static size_t kitty_send_image_rect
+    (kitty_session *ks, const char *keys, uint32_t format,
+    const uint8_t *frame, ptrdiff_t stride, kitty_rect r)
+{
+    size_t pixel_size = format >> 3;
+    kitty_rows src = { frame + r.y * stride + r.x * pixel_size,
+        r.w * pixel_size, stride, r.h };
+    char ctl[128];
+
+    snprintf(ctl, sizeof(ctl), "f=%u,%s,s=%u,v=%u", format, keys, r.w, r.h);
+    return kitty_send_pixels(ks, ctl, format, src);
+}
+
+static size_t kitty_send_rgba_rect
+    (kitty_session *ks, const char *keys, const uint8_t *frame,
+    ptrdiff_t stride, kitty_rect r)
+{
+    return kitty_send_image_rect(ks, keys, kitty_format_rgba, frame,
+        stride, r);
+}
+
+/*
+ * send a rectangle of a frame to edit the root frame of an existing image
+ * in place. the rectangle overwrites the pixels underneath rather than
+ * being alpha blended with them.
+ */
+static size_t kitty_send_rect
+    (kitty_session *ks, uint32_t id, uint32_t format,
+    const uint8_t *frame, uint32_t width, kitty_rect r)
+{
+    char keys[96];
+
+    snprintf(keys, sizeof(keys), "a=f,r=1,X=1,i=%u,x=%u,y=%u",
+        id, r.x, r.y);
+    return kitty_send_image_rect(ks, keys, format, frame,
+        (ptrdiff_t)width * (format >> 3), r);
+}
+
+/*
+ * image placement and deletion
+ *
+ * quiet mode 1 suppresses the OK responses but still reports errors.
+ */
+
+static void kitty_place_image(kitty_session *ks, uint32_t id)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "\x1B_Ga=p,i=%u,q=1\x1B\\", id);
+    kitty_session_write(ks, buf, len);
+}
+
+static void kitty_delete_image(kitty_session *ks, uint32_t id, char what)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "\x1B_Ga=d,d=%c,i=%u,q=1\x1B\\",
+        what, id);
+    kitty_session_write(ks, buf, len);
+}
+
+/*
+ * frame hashing
+ *
+ * 64-bit multiply and rotate hash over 8 byte words with a final
+ * avalanche, used to recognise frames that the terminal already holds.
+ */
+
+static inline uint64_t kitty_hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v * 0xc2b2ae3d27d4eb4fULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint64_t kitty_hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t kitty_hash64(const uint8_t *data, size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, v;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&v, data + i, 8);
+        h = kitty_hash_mix(h, v);
+    }
+    if (i < len) {
+        v = 0;
+        memcpy(&v, data + i, len - i);
+        h = kitty_hash_mix(h, v);
+    }
+    return kitty_hash_final(h);
+}
+
+/*
+ * tile hashing
+ *
+ * hashes a rectangle of rows in place in the style of xxh3. four 64-bit
+ * lanes accumulate 32 byte stripes, each lane adding the product of the
+ * low and high halves of its input mixed with a key plus the input of its
+ * neighbouring lane, so two lanes fit one SSE2 or NEON register and the
+ * vector and scalar versions agree. the key moves along a secret with
+ * each stripe and the lanes are scrambled after every row or 16 stripes,
+ * so permuting rows or stripes changes the hash. the tail of each row is
+ * zero padded to a whole stripe.
+ */
+
+enum { kitty_tile_block = 16 };
+
+static const uint64_t kitty_tile_secret[kitty_tile_block + 4] = {
+    0x2cb0f69f4abea221ULL, 0x9417034723148989ULL,
+    0xdd555950609dfe03ULL, 0xdbafb150deb12800ULL,
+    0x7e789b2e6c442cb6ULL, 0xf41e5636c7e4f8c4ULL,
+    0x0959d150f8fba7e4ULL, 0xa97316f13cdb9eeaULL,
+    0x74cd8258f9520068ULL, 0x55c74a62e116868bULL,
+    0xd2f4c799a2023cbdULL, 0xdf98cb79a37b51b9ULL,
+    0x396f5885524f3905ULL, 0xaf1d56386ca3b276ULL,
+    0xa9ffbe6b5104e85aULL, 0x6bd0c51b9fd533b3ULL,
+    0x980ce91c50ab4b56ULL, 0x28ac395780fe62c5ULL,
+    0x768912e3a6bcedc7ULL, 0x50b3e8c9332c7c88ULL,
+};
+
+static const uint64_t kitty_tile_prime = 0x9e3779b1ULL;
+
+static void kitty_tile_stripe_scalar
+    (uint64_t acc[4], const uint8_t *p, const uint64_t *key)
+{
+    uint64_t v[4];
+    memcpy(v, p, 32);
+    for (int i = 0; i < 4; i++) {
+        uint64_t k = v[i] ^ key[i];
+        acc[i] += (k & 0xffffffff) * (k >> 32) + v[i ^ 1];
+    }
+}
+
+static void kitty_tile_scramble_scalar(uint64_t acc[4])
+{
+    const uint64_t *key = kitty_tile_secret + kitty_tile_block;
+    for (int i = 0; i < 4; i++) {
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ key[i]) * kitty_tile_prime;
+    }
+}
+
+static uint64_t kitty_tile_final(uint64_t acc[4], size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < 4; i++) {
+        h = kitty_hash_mix(h, acc[i]);
+    }
+    return kitty_hash_final(h);
+}
+
+static uint64_t kitty_tile_hash_scalar
+    (const uint8_t *data, ptrdiff_t stride, size_t row_size, uint32_t rows)
+{
+    uint64_t acc[4] = { 0 };
+    uint8_t tail[32];
+
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t *p = data + y * stride;
+        size_t x = 0, n = 0;
+        for (; x + 32 <= row_size; x += 32) {
+            kitty_tile_stripe_scalar(acc, p + x, kitty_tile_secret + n);
+            if (++n == kitty_tile_block) {
+                kitty_tile_scramble_scalar(acc);
+                n = 0;
+            }
+        }
+        if (x < row_size) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p + x, row_size - x);
+            kitty_tile_stripe_scalar(acc, tail, kitty_tile_secret + n);
+        }
+        kitty_tile_scramble_scalar(acc);
+    }
+    return kitty_tile_final(acc, row_size * rows);
+}
+
+#if defined(__SSE2__)
+static inline __m128i kitty_tile_lanes_sse2
+    (__m128i acc, const uint8_t *p, const uint64_t *key)
+{
+    __m128i d = _mm_loadu_si128((const __m128i*)p);
+    __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)key));
+    __m128i hi = _mm_shuffle_epi32(dk, _MM_SHUFFLE(0,3,0,1));
+    __m128i prod = _mm_mul_epu32(dk, hi);
+    __m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1,0,3,2));
+    return _mm_add_epi64(acc, _mm_add_epi64(prod, swap));
+}
+
+static inline __m128i kitty_tile_scramble_sse2(__m128i acc, const uint64_t *key)
+{
+    const __m128i prime = _mm_set1_epi64x(kitty_tile_prime);
+    acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+    acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i*)key));
+    __m128i lo = _mm_mul_epu32(acc, prime);
+    __m128i hi = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+    return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static uint64_t kitty_tile_hash
+    (const uint8_t *data, ptrdiff_t stride, size_t row_size, uint32_t rows)
+{
+    const uint64_t *skey = kitty_tile_secret + kitty_tile_block;
+    __m128i a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128();
+    uint8_t tail[32];
+    uint64_t acc[4];
+
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t *p = data + y * stride;
+        size_t x = 0, n = 0;
+        for (; x + 32 <= row_size; x += 32) {
+            a0 = kitty_tile_lanes_sse2(a0, p + x, kitty_tile_secret + n);
+            a1 = kitty_tile_lanes_sse2(a1, p + x + 16, kitty_tile_secret + n + 2);
+            if (++n == kitty_tile_block) {
+                a0 = kitty_tile_scramble_sse2(a0, skey);
+                a1 = kitty_tile_scramble_sse2(a1, skey + 2);
+                n = 0;
+            }
+        }
+        if (x < row_size) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p + x, row_size - x);
+            a0 = kitty_tile_lanes_sse2(a0, tail, kitty_tile_secret + n);
+            a1 = kitty_tile_lanes_sse2(a1, tail + 16, kitty_tile_secret + n + 2);
+        }
+        a0 = kitty_tile_scramble_sse2(a0, skey);
+        a1 = kitty_tile_scramble_sse2(a1, skey + 2);
+    }
+    _mm_storeu_si128((__m128i*)acc, a0);
+    _mm_storeu_si128((__m128i*)acc + 1, a1);
+    return kitty_tile_final(acc, row_size * rows);
+}
+#elif defined(__aarch64__)
+static inline uint64x2_t kitty_tile_lanes_neon
+    (uint64x2_t acc, const uint8_t *p, const uint64_t *key)
+{
+    uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(p));
+    uint64x2_t dk = veorq_u64(d, vld1q_u64(key));
+    uint64x2_t prod = vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32));
+    return vaddq_u64(acc, vaddq_u64(prod, vextq_u64(d, d, 1)));
+}
+
+static inline uint64x2_t kitty_tile_scramble_neon
+    (uint64x2_t acc, const uint64_t *key)
+{
+    const uint32x2_t prime = vdup_n_u32((uint32_t)kitty_tile_prime);
+    acc = veorq_u64(acc, vshrq_n_u64(acc, 47));
+    acc = veorq_u64(acc, vld1q_u64(key));
+    uint64x2_t lo = vmull_u32(vmovn_u64(acc), prime);
+    uint64x2_t hi = vmull_u32(vshrn_n_u64(acc, 32), prime);
+    return vaddq_u64(lo, vshlq_n_u64(hi, 32));
+}
+
+static uint64_t kitty_tile_hash
+    (const uint8_t *data, ptrdiff_t stride, size_t row_size, uint32_t rows)
+{
+    const uint64_t *skey = kitty_tile_secret + kitty_tile_block;
+    uint64x2_t a0 = vdupq_n_u64(0), a1 = vdupq_n_u64(0);
+    uint8_t tail[32];
+    uint64_t acc[4];
+
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t *p = data + y * stride;
+        size_t x = 0, n = 0;
+        for (; x + 32 <= row_size; x += 32) {
+            a0 = kitty_tile_lanes_neon(a0, p + x, kitty_tile_secret + n);
+            a1 = kitty_tile_lanes_neon(a1, p + x + 16, kitty_tile_secret + n + 2);
+            if (++n == kitty_tile_block) {
+                a0 = kitty_tile_scramble_neon(a0, skey);
+                a1 = kitty_tile_scramble_neon(a1, skey + 2);
+                n = 0;
+            }
+        }
+        if (x < row_size) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p + x, row_size - x);
+            a0 = kitty_tile_lanes_neon(a0, tail, kitty_tile_secret + n);
+            a1 = kitty_tile_lanes_neon(a1, tail + 16, kitty_tile_secret + n + 2);
+        }
+        a0 = kitty_tile_scramble_neon(a0, skey);
+        a1 = kitty_tile_scramble_neon(a1, skey + 2);
+    }
+    vst1q_u64(acc, a0);
+    vst1q_u64(acc + 2, a1);
+    return kitty_tile_final(acc, row_size * rows);
+}
+#else
+static uint64_t kitty_tile_hash
+    (const uint8_t *data, ptrdiff_t stride, size_t row_size, uint32_t rows)
+{
+    return kitty_tile_hash_scalar(data, stride, row_size, rows);
+}
+#endif
+
+/*
+ * terminal image cache
+ *
+ * records the hash of each image uploaded to the terminal against its id
+ * so a repeated frame can be placed again instead of being uploaded. when
+ * the images held by the terminal would exceed the budget, the least
+ * recently used are deleted along with their data. ids are never reused
+ * so a stale placement can not show the wrong image.
+ */
+
+typedef struct kitty_cache_entry {
+    uint64_t hash;
+    uint64_t used;
+    size_t size;
+    uint32_t id;
+} kitty_cache_entry;
+
+typedef struct kitty_cache {
+    kitty_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    size_t budget;
+    uint64_t tick;
+    uint32_t next_id;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} kitty_cache;
+
+static void kitty_cache_init(kitty_cache *kc, size_t budget, uint32_t first_id)
+{
+    memset(kc, 0, sizeof(kitty_cache));
+    kc->budget = budget;
+    kc->next_id = first_id;
+}
+
+static void kitty_cache_destroy(kitty_cache *kc)
+{
+    free(kc->entries);
+    kc->entries = NULL;
+    kc->count = kc->capacity = 0;
+}
+
+/* returns the id of the image with the given hash, or 0 on a miss */
+static uint32_t kitty_cache_lookup(kitty_cache *kc, uint64_t hash)
+{
+    for (size_t i = 0; i < kc->count; i++) {
+        if (kc->entries[i].hash == hash) {
+            kc->entries[i].used = ++kc->tick;
+            kc->hits++;
+            return kc->entries[i].id;
+        }
+    }
+    kc->misses++;
+    return 0;
+}
+
+/* evicts images to make room and returns the id to upload the image as */
+static uint32_t kitty_cache_insert
+    (kitty_session *ks, kitty_cache *kc, uint64_t hash, size_t size)
+{
+    kitty_cache_entry *e;
+
+    while (kc->count > 0 && kc->bytes + size > kc->budget) {
+        size_t lru = 0;
+        for (size_t i = 1; i < kc->count; i++) {
+            if (kc->entries[i].used < kc->entries[lru].used) lru = i;
+        }
+        kitty_delete_image(ks, kc->entries[lru].id, 'I');
+        kc->bytes -= kc->entries[lru].size;
+        kc->entries[lru] = kc->entries[--kc->count];
+        kc->evictions++;
+    }
+    if (kc->count == kc->capacity) {
+        size_t capacity = kc->capacity ? kc->capacity * 2 : 16;
+        e = realloc(kc->entries, capacity * sizeof(kitty_cache_entry));
+        if (!e) {
+            fprintf(stderr, "error: kitty_cache_insert realloc failed\n");
+            exit(1);
+        }
+        kc->entries = e;
+        kc->capacity = capacity;
+    }
+    e = &kc->entries[kc->count++];
+    e->hash = hash;
+    e->used = ++kc->tick;
+    e->size = size;
+    e->id = kc->next_id++;
+    kc->bytes += size;
+    return e->id;
+}
+
+/*
+ * terminal input
+ *
+ * input from the terminal is read into a buffer and parsed in place by a
+ * state machine that resumes where the last read left off, so all of the
+ * responses and keys in a read are seen, including sequences split across
+ * reads. events point into the buffer and are only valid for the duration
+ * of the callback. an incomplete sequence is moved to the front of the
+ * buffer before the next read, so complete sequences are never copied.
+ */
+
+enum kitty_event_type {
+    kitty_event_key,
+    kitty_event_ack,
+    kitty_event_error,
+    kitty_event_cursor,
+    kitty_event_cell_size
+};
+
+typedef struct kitty_event {
+    int type;
+    int key;
+    uint32_t iid;
+    const char *status;
+    int x, y;
+} kitty_event;
+
+enum kitty_input_state {
+    kitty_input_ground,
+    kitty_input_esc,
+    kitty_input_csi,
+    kitty_input_apc,
+    kitty_input_apc_esc
+};
+
+enum { kitty_input_size = 4096 };
+
+typedef void (*kitty_event_cb)(kitty_event *ev, void *arg);
+
+typedef struct kitty_input {
+    char buf[kitty_input_size];
+    size_t len;
+    size_t pos;
+    size_t start;
+    int state;
+    uint64_t events;
+    uint64_t overflows;
+} kitty_input;
+
+static size_t kitty_input_params(const char *s, size_t len, int *p, size_t n)
+{
+    size_t count = 0;
+    int v = 0, digits = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] >= '0' && s[i] <= '9') {
+            v = v * 10 + (s[i] - '0');
+            digits++;
+        } else {
+            if (digits && count < n) p[count++] = v;
+            v = digits = 0;
+            if (s[i] != ';') break;
+        }
+    }
+    return count;
+}
+
+/* CSI parameters and final byte, following "\x1B[" */
+static void kitty_input_on_csi
+    (kitty_input *ki, char *s, size_t len, kitty_event_cb cb, void *arg)
+{
+    kitty_event ev = { 0 };
+    int p[3];
+    size_t n = kitty_input_params(s, len, p, 3);
+
+    if (s[len-1] == 'R' && n == 2) {
+        ev.type = kitty_event_cursor;
+        ev.y = p[0];
+        ev.x = p[1];
+    } else if (s[len-1] == 't' && n == 3 && p[0] == 6) {
+        ev.type = kitty_event_cell_size;
+        ev.y = p[1];
+        ev.x = p[2];
+    } else {
+        return;
+    }
+    ki->events++;
+    cb(&ev, arg);
+}
+
+/*
+ * APC body following "\x1B_" up to the string terminator. graphics
+ * responses are "G<keys>;<status>", and the status is terminated in place
+ * by overwriting the ESC of the string terminator.
+ */
+static void kitty_input_on_apc
+    (kitty_input *ki, char *s, size_t len, kitty_event_cb cb, void *arg)
+{
+    kitty_event ev = { 0 };
+    char *semi = (char*)memchr(s, ';', len);
+
+    if (len < 1 || s[0] != 'G' || !semi) {
+        return;
+    }
+    for (char *k = s + 1; k < semi; k++) {
+        if (k[0] == 'i' && k[1] == '=' && (k == s + 1 || k[-1] == ',')) {
+            ev.iid = (uint32_t)strtoul(k + 2, NULL, 10);
+        }
+    }
+    s[len] = '\0';
+    ev.status = semi + 1;
+    ev.type = strcmp(ev.status, "OK") == 0 ? kitty_event_ack
+                                            : kitty_event_error;
+    ki->events++;
+    cb(&ev, arg);
+}
+
+static void kitty_input_on_key
+    (kitty_input *ki, int key, kitty_event_cb cb, void *arg)
+{
+    kitty_event ev = { 0 };
+    ev.type = kitty_event_key;
+    ev.key = key;
+    ki->events++;
+    cb(&ev, arg);
+}
+
+/* scan the bytes added to the buffer since the last call */
+static void kitty_input_parse(kitty_input *ki, kitty_event_cb cb, void *arg)
+{
+    char *buf = ki->buf;
+
+    while (ki->pos < ki->len) {
+        char c = buf[ki->pos++];
+        switch (ki->state) {
+        case kitty_input_ground:
+            if (c == '\x1B') {
+                ki->start = ki->pos - 1;
+                ki->state = kitty_input_esc;
+            } else {
+                kitty_input_on_key(ki, (uint8_t)c, cb, arg);
+            }
+            break;
+        case kitty_input_esc:
+            if (c == '[') {
+                ki->state = kitty_input_csi;
+            } else if (c == '_') {
+                ki->state = kitty_input_apc;
+            } else {
+                /* a lone escape key, rescan what follows it */
+                kitty_input_on_key(ki, '\x1B', cb, arg);
+                ki->state = kitty_input_ground;
+                ki->pos--;
+            }
+            break;
+        case kitty_input_csi:
+            if (c >= 0x40 && c <= 0x7e) {
+                kitty_input_on_csi(ki, buf + ki->start + 2,
+                    ki->pos - ki->start - 2, cb, arg);
+                ki->state = kitty_input_ground;
+            }
+            break;
+        case kitty_input_apc:
+            if (c == '\x1B') ki->state = kitty_input_apc_esc;
+            break;
+        case kitty_input_apc_esc:
+            if (c == '\\') {
+                kitty_input_on_apc(ki, buf + ki->start + 2,
+                    ki->pos - ki->start - 4, cb, arg);
+                ki->state = kitty_input_ground;
+            } else if (c != '\x1B') {
+                ki->state = kitty_input_apc;
+            }
+            break;
+        }
+    }
+
+    /* keep only the incomplete sequence, if any */
+    size_t keep = ki->state == kitty_input_ground ? ki->len : ki->start;
+    memmove(buf, buf + keep, ki->len - keep);
+    ki->len -= keep;
+    ki->pos -= keep;
+    ki->start = 0;
+}
+
+/*
+ * read everything that is available from fd and parse it. returns the
+ * number of bytes read or -1 on error or end of file.
+ */
+static ssize_t kitty_input_read
+    (kitty_input *ki, int fd, kitty_event_cb cb, void *arg)
+{
+    ssize_t total = 0, r;
+    size_t space;
+
+    do {
+        /* a sequence too long for the buffer is discarded */
+        if (ki->len == sizeof(ki->buf)) {
+            ki->len = ki->pos = ki->start = 0;
+            ki->state = kitty_input_ground;
+            ki->overflows++;
+        }
+        space = sizeof(ki->buf) - ki->len;
+        r = read(fd, ki->buf + ki->len, space);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return total ? total : -1;
+        ki->len += r;
+        total += r;
+        kitty_input_parse(ki, cb, arg);
+        if ((size_t)r < space) break;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) break;
+    } while (1);
+
+    return total;
+}
+
+/*
+ * terminal input dispatch
+ *
+ * keys and image responses go to the application callbacks. a caller
+ * waiting for a particular response passes a kitty_expect, which takes
+ * the matching event instead of it being dispatched.
+ */
+
+typedef void (*key_cb)(int k);
+
+static key_cb* _get_key_callback()
+{
+    static key_cb cb;
+    return &cb;
+}
+
+static void kitty_key_callback(key_cb cb)
+{
+    *_get_key_callback() = cb;
+}
+
+/* the status is "OK" or the error the terminal gave for the image */
+typedef void (*ack_cb)(int iid, const char *status);
+
+static ack_cb* _get_ack_callback()
+{
+    static ack_cb cb;
+    return &cb;
+}
+
+static void kitty_ack_callback(ack_cb cb)
+{
+    *_get_ack_callback() = cb;
+}
+
+static kitty_input* _get_input()
+{
+    static kitty_input ki;
+    return &ki;
+}
+
+typedef struct kitty_expect {
+    int type;
+    uint32_t iid;
+    int done;
+    kitty_event ev;
+    char status[64];
+} kitty_expect;
+
+static void kitty_dispatch_event(kitty_event *ev, void *arg)
+{
+    kitty_expect *ex = (kitty_expect*)arg;
+    int response = ev->type == kitty_event_ack ||
+        ev->type == kitty_event_error;
+
+    if (ex && !ex->done && (ex->type == ev->type ||
+            (ex->type == kitty_event_ack && response)) &&
+            (!response || ex->iid == ev->iid)) {
+        ex->ev = *ev;
+        if (ev->status) {
+            snprintf(ex->status, sizeof(ex->status), "%s", ev->status);
+            ex->ev.status = ex->status;
+        }
+        ex->done = 1;
+        return;
+    }
+    if (ev->type == kitty_event_key && *_get_key_callback()) {
+        (*_get_key_callback())(ev->key);
+    } else if (response && *_get_ack_callback()) {
+        (*_get_ack_callback())(ev->iid, ev->status);
+    }
+}
+
+static int kitty_poll_input(int timeout, kitty_expect *ex)
+{
+    struct pollfd fds[1] = { { fileno(stdin), POLLIN, 0 } };
+    int r = poll(fds, 1, timeout);
+
+    if (r > 0 && (fds[0].revents & POLLIN)) {
+        kitty_input_read(_get_input(), fileno(stdin),
+            kitty_dispatch_event, ex);
+    }
+    return r;
+}
+
+/*
+ * wait for the terminal input to contain the expected event, dispatching
+ * other events as they arrive. a negative timeout waits indefinitely.
+ */
+static int kitty_expect_event(kitty_expect *ex, int timeout)
+{
+    uint64_t deadline = kitty_clock_ns() + (uint64_t)timeout * 1000000;
+
+    while (!ex->done) {
+        int left = -1;
+        if (timeout >= 0) {
+            uint64_t now = kitty_clock_ns();
+            if (now >= deadline) break;
+            left = (int)((deadline - now + 999999) / 1000000);
+        }
+        if (kitty_poll_input(left, ex) < 0 && errno != EINTR) break;
+    }
+    return ex->done;
+}
+
+/*
+ * wait up to millis for terminal input, then handle all of it.
+ */
+static void kitty_poll_events(int millis)
+{
+    kitty_poll_input(millis, NULL);
+}
+
+/*
+ * kitty terminal helpers
+ */
+
+struct pos  { int x, y; };
+
+typedef struct pos pos;
+
+static int kitty_format_position(char *buf, size_t len, int x, int y)
+{
+    return snprintf(buf, len, "\x1B[%d;%dH", y, x);
+}
+
+static void kitty_set_position(int x, int y)
+{
+    char buf[32];
+    kitty_format_position(buf, sizeof(buf), x, y);
+    fputs(buf, stdout);
+    fflush(stdout);
+}
+
+static void kitty_session_position(kitty_session *ks, int x, int y)
+{
+    char buf[32];
+    int len = kitty_format_position(buf, sizeof(buf), x, y);
+    kitty_session_write(ks, buf, len);
+}
+
+static pos kitty_get_position()
+{
+    kitty_expect ex = { .type = kitty_event_cursor };
+    pos p = { 0, 0 };
+
+    fputs("\x1B[6n", stdout);
+    fflush(stdout);
+    if (kitty_expect_event(&ex, -1)) {
+        p.x = ex.ev.x;
+        p.y = ex.ev.y;
+    }
+    return p;
+}
+
+/*
+ * cell size in pixels, from the terminal window size if the terminal
+ * reports one, otherwise by asking with CSI 16t. zero if both fail.
+ */
+static pos kitty_get_cell_size(int timeout)
+{
+    struct winsize ws;
+    pos c = { 0, 0 };
+
+    if (ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0 &&
+            ws.ws_col && ws.ws_row && ws.ws_xpixel && ws.ws_ypixel) {
+        c.x = ws.ws_xpixel / ws.ws_col;
+        c.y = ws.ws_ypixel / ws.ws_row;
+        return c;
+    }
+    kitty_expect ex = { .type = kitty_event_cell_size };
+    fputs("\x1B[16t", stdout);
+    fflush(stdout);
+    if (kitty_expect_event(&ex, timeout)) {
+        c.x = ex.ev.x;
+        c.y = ex.ev.y;
+    }
+    return c;
+}
+
+static void kitty_hide_cursor()
+{
+    puts("\x1B[?25l");
+}
+
+static void kitty_show_cursor()
+{
+    puts("\x1B[?25h");
+}
+
+/*
+ * query whether the terminal can read shared memory objects or files
+ * from us using the session medium.
+ *
+ * sends a 1x1 query (a=q) using the medium and waits for the response,
+ * which is only "OK" if the terminal could read the data. remote
+ * terminals fail the query, in which case we use direct mode.
+ */
+static int kitty_query_medium(kitty_session *ks, int timeout)
+{
+    const uint8_t pixel[3] = { 0, 0, 0 };
+    char path[256], ctl[64];
+    kitty_expect ex = { .type = kitty_event_ack, .iid = 31 };
+
+    if (kitty_medium_write(ks, path, sizeof(path), pixel, sizeof(pixel), 0)) {
+        return 0;
+    }
+    snprintf(ctl, sizeof(ctl), "a=q,i=31,s=1,v=1,f=24,t=%c", ks->medium);
+    kitty_send_path(ks, ctl, path);
+    kitty_session_flush(ks);
+    kitty_expect_event(&ex, timeout);
+    kitty_medium_unlink(ks, path);
+
+    return ex.done && ex.ev.type == kitty_event_ack;
+}
+
+/*
+ * flip image buffer y-axis
+ */
+static void kitty_flip_rows
+    (uint8_t* buffer, size_t line_size, uint32_t height)
+{
+    /* Iterate only half the buffer to get a full flip */
+    size_t rows = height >> 1;
+    uint8_t* scan_line = (uint8_t*)alloca(line_size);
+
+    for (uint32_t rowIndex = 0; rowIndex < rows; rowIndex++)
+    {
+        size_t l1 = rowIndex * line_size;
+        size_t l2 = (height - rowIndex - 1) * line_size;
+        memcpy(scan_line, buffer + l1, line_size);
+        memcpy(buffer + l1, buffer + l2, line_size);
+        memcpy(buffer + l2, scan_line, line_size);
+    }
+}
+
+static void kitty_copy_flip
+    (uint8_t* dst, const uint8_t* src, size_t line_size, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(dst + (height - y - 1) * line_size, src + y * line_size,
+            line_size);
+    }
+}
+
+static void kitty_flip_buffer_y
+    (uint32_t* buffer, uint32_t width, uint32_t height)
+{
+    kitty_flip_rows((uint8_t*)buffer, width * sizeof(uint32_t), height);
+}
+
+/*
+ * pack RGBA rows to RGB while flipping the y-axis
+ *
+ * converts and flips in a single pass from the render buffer into a
+ * separate RGB buffer, which is 25% smaller than the RGBA frame. the
+ * vector loops shuffle 4 (SSSE3) or 16 (NEON) pixels per step and leave
+ * the last few pixels of each row to the scalar loop so that overlapping
+ * stores never cross into the next row.
+ */
+
+static void kitty_pack_rgb_row_scalar
+    (uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x*3+0] = src[x*4+0];
+        dst[x*3+1] = src[x*4+1];
+        dst[x*3+2] = src[x*4+2];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void kitty_pack_rgb_row_ssse3
+    (uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+        12, 13, 14, -1, -1, -1, -1);
+    uint32_t x = 0;
+
+    /* 16 byte stores write 12 bytes, so keep 2 pixels of slack */
+    for (; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x*4));
+        _mm_storeu_si128((__m128i*)(dst + x*3), _mm_shuffle_epi8(v, shuf));
+    }
+    kitty_pack_rgb_row_scalar(dst + x*3, src + x*4, width - x);
+}
+
+static int kitty_has_ssse3()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+#if defined(__aarch64__)
+static void kitty_pack_rgb_row_neon
+    (uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t v = vld4q_u8(src + x*4);
+        uint8x16x3_t r = { { v.val[0], v.val[1], v.val[2] } };
+        vst3q_u8(dst + x*3, r);
+    }
+    kitty_pack_rgb_row_scalar(dst + x*3, src + x*4, width - x);
+}
+#endif
+
+static void kitty_pack_rgb_flip
+    (uint8_t *dst, const uint8_t *src, uint32_t width, uint32_t height)
+{
+    void (*pack_row)(uint8_t*, const uint8_t*, uint32_t) =
+        kitty_pack_rgb_row_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (kitty_has_ssse3()) pack_row = kitty_pack_rgb_row_ssse3;
+#elif defined(__aarch64__)
+    pack_row = kitty_pack_rgb_row_neon;
+#endif
+
+    for (uint32_t y = 0; y < height; y++) {
+        pack_row(dst + (size_t)(height - y - 1) * width * 3,
+            src + (size_t)y * width * 4, width);
+    }
+}
+
+/*
+ * poll for input and for output space if there is queued output, then
+ * write what the terminal will take and handle any input.
+ */
+static int kitty_session_poll(kitty_session *ks, int timeout)
+{
+    struct pollfd fds[2] = {
+        { fileno(stdin), POLLIN, 0 },
+        { ks->out_fd, POLLOUT, 0 }
+    };
+    int r = poll(fds, ks->out_count ? 2 : 1, timeout);
+
+    if (r < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (ks->out_count && (fds[1].revents & POLLOUT)) {
+        kitty_out_pump(ks);
+    }
+    if (fds[0].revents & POLLIN) {
+        kitty_poll_events(0);
+    }
+    return r;
+}
+
+/*
+ * wait for the frame interval, writing queued output whenever the terminal
+ * can take it and handling input as it arrives.
+ */
+static void kitty_session_wait(kitty_session *ks, int millis)
+{
+    uint64_t deadline = kitty_clock_ns() + (uint64_t)millis * 1000000;
+
+    for (;;) {
+        uint64_t now = kitty_clock_ns();
+        int left = now < deadline ?
+            (int)((deadline - now + 999999) / 1000000) : 0;
+        if (kitty_session_poll(ks, left) < 0 || left == 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * ack flow control
+ *
+ * up to window images may be uploaded and not yet acknowledged. each
+ * frame takes the next id from a ring of window ids, so an id is only
+ * reused once the frame that last used it has been acknowledged, and the
+ * next frame is rendered as soon as a credit frees up. an image that is
+ * not acknowledged within the timeout is counted as lost and its credit
+ * returned, so a terminal that drops responses can not stall the loop.
+ *
+ * images sent quietly are never acknowledged. the terminal handles images
+ * in order, so they are released by the acknowledgement of a later image.
+ */
+
+enum { kitty_flow_max = 64 };
+
+typedef struct kitty_flow {
+    uint32_t window;
+    uint32_t first_id;
+    uint32_t next;
+    uint32_t inflight;
+    uint64_t sent_ns[kitty_flow_max];
+    uint8_t pending[kitty_flow_max];
+    uint64_t acks;
+    uint64_t lost;
+    uint64_t rtt_sum;
+    uint64_t rtt_min;
+    uint64_t rtt_max;
+} kitty_flow;
+
+static void kitty_flow_init(kitty_flow *kf, uint32_t window, uint32_t first_id)
+{
+    memset(kf, 0, sizeof(kitty_flow));
+    kf->window = window < 1 ? 1 : window > kitty_flow_max ?
+        kitty_flow_max : window;
+    kf->first_id = first_id;
+    kf->rtt_min = UINT64_MAX;
+}
+
+static uint32_t kitty_flow_next_id(kitty_flow *kf)
+{
+    return kf->first_id + kf->next;
+}
+
+static void kitty_flow_sent(kitty_flow *kf, uint32_t id, int quiet)
+{
+    uint32_t slot = id - kf->first_id;
+    /* a slot still pending after a failed wait is reused, not added */
+    if (!kf->pending[slot]) kf->inflight++;
+    kf->sent_ns[slot] = kitty_clock_ns();
+    kf->pending[slot] = quiet ? 2 : 1;
+    kf->next = (kf->next + 1) % kf->window;
+}
+
+/* returns the round trip of the image, zero if it was not in flight */
+static uint64_t kitty_flow_ack(kitty_flow *kf, uint32_t id)
+{
+    uint32_t slot = id - kf->first_id;
+    if (id < kf->first_id || slot >= kf->window || !kf->pending[slot]) {
+        return 0;
+    }
+    uint64_t sent = kf->sent_ns[slot], rtt = kitty_clock_ns() - sent;
+    kf->pending[slot] = 0;
+    kf->inflight--;
+    for (uint32_t i = 0; i < kf->window; i++) {
+        if (kf->pending[i] == 2 && kf->sent_ns[i] <= sent) {
+            kf->pending[i] = 0;
+            kf->inflight--;
+        }
+    }
+    kf->acks++;
+    kf->rtt_sum += rtt;
+    if (rtt < kf->rtt_min) kf->rtt_min = rtt;
+    if (rtt > kf->rtt_max) kf->rtt_max = rtt;
+    return rtt;
+}
+
+/*
+ * wait for a credit, writing queued output and handling input meanwhile.
+ * the timeout is stretched to four times the mean round trip so that a
+ * slow terminal does not have its images expired while still in transit.
+ */
+static void kitty_flow_wait(kitty_session *ks, kitty_flow *kf, int timeout)
+{
+    uint64_t mean = kf->acks ? kf->rtt_sum / kf->acks / 1000000 : 0;
+    if ((uint64_t)timeout < mean * 4) timeout = (int)(mean * 4);
+
+    while (kf->inflight >= kf->window) {
+        uint32_t slot = kf->next;
+        uint64_t waited = (kitty_clock_ns() - kf->sent_ns[slot]) / 1000000;
+        if (!kf->pending[slot]) {
+            break;
+        }
+        if (waited >= (uint64_t)timeout) {
+            kf->pending[slot] = 0;
+            kf->inflight--;
+            kf->lost++;
+            break;
+        }
+        if (kitty_session_poll(ks, timeout - (int)waited) < 0) {
+            break;
+        }
+    }
+}
+
+/*
+ * adaptive frame pacing
+ *
+ * frames start on deadlines from a monotonic clock timer rather than after
+ * a fixed delay, so the time spent rendering and sending a frame does not
+ * add to the interval. the period starts at the target frame rate and is
+ * stretched to the measured render and encode cost when that is longer.
+ * with a latency budget, the period backs off while the acknowledgement
+ * round trip exceeds the budget, up to one frame per round trip, and
+ * recovers towards the target once the terminal catches up. a frame that
+ * misses its deadline starts at once and the missed periods are skipped
+ * rather than sent in a burst.
+ */
+
+typedef struct kitty_pacer {
+    int fd;
+    uint64_t target_ns;
+    uint64_t period_ns;
+    uint64_t latency_ns;
+    uint64_t next_ns;
+    uint64_t last_ns;
+    uint64_t cost_ns;
+    uint64_t rtt_ns;
+    uint64_t skipped;
+    uint64_t *intervals;
+    uint64_t *jitter;
+    size_t count;
+    size_t capacity;
+} kitty_pacer;
+
+static void kitty_pacer_init(kitty_pacer *kp, double fps, uint32_t latency_ms)
+{
+    memset(kp, 0, sizeof(kitty_pacer));
+    kp->target_ns = kp->period_ns = (uint64_t)(1e9 / fps);
+    kp->latency_ns = (uint64_t)latency_ms * 1000000;
+#ifdef __linux__
+    kp->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+    kp->fd = -1;
+#endif
+}
+
+static void kitty_pacer_destroy(kitty_pacer *kp)
+{
+    if (kp->fd >= 0) close(kp->fd);
+    free(kp->intervals);
+    free(kp->jitter);
+    kp->intervals = kp->jitter = NULL;
+    kp->fd = -1;
+}
+
+/* exponentially weighted moving average with a weight of 1/8 */
+static void kitty_pacer_ewma(uint64_t *avg, uint64_t sample)
+{
+    *avg = *avg ? *avg - (*avg >> 3) + (sample >> 3) : sample;
+}
+
+/* render and encode time of a frame */
+static void kitty_pacer_cost(kitty_pacer *kp, uint64_t ns)
+{
+    kitty_pacer_ewma(&kp->cost_ns, ns);
+}
+
+/* acknowledgement round trip of a frame */
+static void kitty_pacer_rtt(kitty_pacer *kp, uint64_t ns)
+{
+    if (ns) kitty_pacer_ewma(&kp->rtt_ns, ns);
+}
+
+static void kitty_pacer_adapt(kitty_pacer *kp)
+{
+    uint64_t floor = kp->cost_ns > kp->target_ns ? kp->cost_ns
+                                                  : kp->target_ns;
+
+    /* backing off beyond one frame per round trip does not help */
+    if (kp->latency_ns && kp->rtt_ns > kp->latency_ns) {
+        uint64_t ceiling = kp->rtt_ns > floor ? kp->rtt_ns : floor;
+        kp->period_ns += kp->period_ns >> 3;
+        if (kp->period_ns > ceiling) kp->period_ns = ceiling;
+    } else if (kp->period_ns > floor) {
+        uint64_t step = kp->period_ns >> 4;
+        kp->period_ns -= step < kp->period_ns - floor ? step
+                                                      : kp->period_ns - floor;
+    }
+    if (kp->period_ns < floor) kp->period_ns = floor;
+}
+
+static void kitty_pacer_sample(kitty_pacer *kp, uint64_t now)
+{
+    if (kp->count == kp->capacity) {
+        size_t capacity = kp->capacity ? kp->capacity << 1 : 1024;
+        uint64_t *intervals = (uint64_t*)realloc(kp->intervals,
+            capacity * sizeof(uint64_t));
+        if (intervals) kp->intervals = intervals;
+        uint64_t *jitter = (uint64_t*)realloc(kp->jitter,
+            capacity * sizeof(uint64_t));
+        if (jitter) kp->jitter = jitter;
+        if (!intervals || !jitter) return;
+        kp->capacity = capacity;
+    }
+    uint64_t interval = now - kp->last_ns;
+    kp->intervals[kp->count] = interval;
+    kp->jitter[kp->count] = interval > kp->period_ns ?
+        interval - kp->period_ns : kp->period_ns - interval;
+    kp->count++;
+}
+
+/*
+ * wait for the deadline of the next frame, writing queued output and
+ * handling input meanwhile. returns the start time of the frame.
+ */
+static uint64_t kitty_pacer_wait(kitty_session *ks, kitty_pacer *kp)
+{
+    uint64_t now = kitty_clock_ns();
+
+    kitty_pacer_adapt(kp);
+    kp->next_ns = kp->last_ns ? kp->next_ns + kp->period_ns : now;
+    if (kp->next_ns < now) {
+        kp->skipped += (now - kp->next_ns) / kp->period_ns;
+        kp->next_ns = now;
+    }
+
+#ifdef __linux__
+    struct itimerspec its = { { 0, 0 }, {
+        (time_t)(kp->next_ns / 1000000000), (long)(kp->next_ns % 1000000000)
+    } };
+    if (kp->fd >= 0 && kp->next_ns > now) {
+        timerfd_settime(kp->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+#endif
+
+    while ((now = kitty_clock_ns()) < kp->next_ns) {
+        struct pollfd fds[3] = {
+            { fileno(stdin), POLLIN, 0 },
+            { kp->fd, POLLIN, 0 },
+            { ks->out_fd, POLLOUT, 0 }
+        };
+        int timeout = kp->fd >= 0 ? -1 :
+            (int)((kp->next_ns - now + 999999) / 1000000);
+        if (poll(fds, ks->out_count ? 3 : 2, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ks->out_count && (fds[2].revents & POLLOUT)) {
+            kitty_out_pump(ks);
+        }
+        if (fds[0].revents & POLLIN) {
+            kitty_poll_events(0);
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(kp->fd, &expirations, sizeof(expirations)) > 0) break;
+        }
+    }
+
+    now = kitty_clock_ns();
+    if (kp->last_ns) {
+        kitty_pacer_sample(kp, now);
+    }
+    kp->last_ns = now;
+    return now;
+}
+
+static int kitty_u64_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* percentile of samples, sorting them in place */
+static uint64_t kitty_percentile(uint64_t *samples, size_t count, double p)
+{
+    if (!count) return 0;
+    qsort(samples, count, sizeof(uint64_t), kitty_u64_compare);
+    size_t i = (size_t)(p / 100. * (count - 1) + 0.5);
+    return samples[i < count ? i : count - 1];
 }
 
 static struct termios* _get_termios_backup()